@@ -5,8 +5,13 @@
 #include "runtime_common.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <execinfo.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,25 +19,103 @@
 #include <time.h>
 #include <unistd.h>
 
-static const size_t INIT_HEAP_SIZE = MINIMUM_HEAP_CAPACITY;
-
 #ifdef DEBUG_VERSION
-size_t cur_id = 0;
+// the objects are numbered in each thread, as isolates may allocate on several at once
+__thread size_t cur_id = 0;
 #endif
 
-static extra_roots_pool extra_roots;
+__thread isolate *current_isolate = NULL;
+
+static double gc_clock (void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// the size in words from an environment variable, or the default
+static size_t getenv_size (const char *name, size_t default_size) {
+  const char *value = getenv(name);
+  size_t      words = value == NULL ? 0 : gc_parse_size(value);
+  return words == 0 ? default_size : words;
+}
+
+// the number from an environment variable if it is in [low, high], or the default
+static int getenv_int (const char *name, int low, int high, int default_value) {
+  const char *value = getenv(name);
+  if (value == NULL) { return default_value; }
+  char *end;
+  errno  = 0;
+  long n = strtol(value, &end, 10);
+  return end == value || *end != 0 || errno == ERANGE || n < low || n > high ? default_value
+                                                                             : (int)n;
+}
+
+isolate *isolate_create (void) {
+  isolate *i = calloc(1, sizeof(isolate));
+  if (i == NULL) {
+    perror("ERROR: isolate_create: calloc failed\n");
+    exit(1);
+  }
+  heap_policy *policy  = &i->policy;
+  size_t       initial = getenv_size("LAMA_HEAP_SIZE", 0);
+  // a smaller initial size lowers the default minimum with it
+  size_t minimum     = initial == 0 ? INITIAL_HEAP_SIZE : MIN(initial, INITIAL_HEAP_SIZE);
+  policy->maximum    = getenv_size("LAMA_HEAP_MAX", (size_t)-1 / sizeof(size_t));
+  policy->minimum    = MAX(getenv_size("LAMA_HEAP_MIN", minimum), MINIMUM_HEAP_CAPACITY);
+  policy->minimum    = MIN(policy->minimum, policy->maximum);
+  policy->initial    = MIN(MAX(initial, policy->minimum), policy->maximum);
+  policy->time_ratio = getenv_int("LAMA_GC_TIME_RATIO", 1, 99, GC_TIME_RATIO) / 100.0;
+  policy->room       = EXTRA_ROOM_HEAP_COEFFICIENT - 1;
+  policy->last_end    = gc_clock();
+
+  size_t space_size = WORDS_TO_BYTES(policy->initial);
+  i->heap.begin     = mmap(
+      NULL, space_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (i->heap.begin == MAP_FAILED) {
+    perror("ERROR: isolate_create: mmap failed\n");
+    exit(1);
+  }
+  i->heap.end     = i->heap.begin + policy->initial;
+  i->heap.size    = policy->initial;
+  i->heap.current = i->heap.begin;
+  i->mark_bits    = mmap(NULL,
+                      MARK_BITS_SIZE(policy->initial),
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+  if (i->mark_bits == MAP_FAILED) {
+    perror("ERROR: isolate_create: mmap failed\n");
+    exit(1);
+  }
+
+  // as with --gc-threads=, any positive number is valid and more than MAX_GC_THREADS are capped
+  i->gc_threads = MIN(getenv_int("LAMA_GC_THREADS", 1, INT_MAX, 1), MAX_GC_THREADS);
+  return i;
+}
+
+void isolate_enter (isolate *i) { current_isolate = i; }
+
+void isolate_destroy (isolate *i) {
+  munmap(i->heap.begin, WORDS_TO_BYTES(i->heap.size));
+  if (i->nursery.begin != NULL) { munmap(i->nursery.begin, WORDS_TO_BYTES(i->nursery.size)); }
+  free(i->remembered.slots);
+  free(i->remembered.bits);
+  munmap(i->mark_bits, MARK_BITS_SIZE(i->heap.size));
+  free(i->mark_stack.items);
+  free(i);
+}
+
+// the state of the current isolate
+#define heap (current_isolate->heap)
+#define nursery (current_isolate->nursery)
+#define remembered (current_isolate->remembered)
+#define extra_roots (current_isolate->extra_roots)
 
-size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
 #ifdef LAMA_ENV
 extern const size_t __start_custom_data, __stop_custom_data;
 #endif
 
-#ifdef DEBUG_VERSION
-memory_chunk heap;
-#else
-static memory_chunk heap;
-#endif
-
 #ifdef DEBUG_VERSION
 void dump_heap ();
 #endif
@@ -43,11 +126,13 @@ void handler (int sig) {
 
   // get void*'s for all entries on the stack
   size = backtrace(array, 10);
-  fprintf(stderr, "heap size is %zu\n", heap.size);
+  if (current_isolate != NULL) { fprintf(stderr, "heap size is %zu\n", heap.size); }
   backtrace_symbols_fd(array, size, STDERR_FILENO);
   exit(1);
 }
 
+static void *alloc_generational (size_t size);
+
 void *alloc (size_t size) {
 #ifdef DEBUG_VERSION
   ++cur_id;
@@ -57,6 +142,7 @@ void *alloc (size_t size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "allocation of size %zu words (%zu bytes): ", size, bytes_sz);
 #endif
+  if (nursery.begin != NULL) { return alloc_generational(size); }
   void *p = gc_alloc_on_existing_heap(size);
   if (!p) {
     // not enough place in the heap, need to perform GC cycle
@@ -134,11 +220,8 @@ FILE *print_objects_traversal (char *filename, bool marked) {
   ftruncate(fileno(f), 0);
   for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it);
        heap_next_obj_iterator(&it)) {
-    void *obj_header = it.current;
-    data *obj_data   = TO_DATA(get_object_content_ptr(obj_header));
-    if ((obj_data->forward_address & 1) == marked) {
-      objects_dfs(f, get_object_content_ptr(obj_header));
-    }
+    void *obj_content = get_object_content_ptr(it.current);
+    if (is_marked(obj_content) == marked) { objects_dfs(f, obj_content); }
   }
 
   // resetting bit that represent mark-bit for this internal dfs-traversal
@@ -172,17 +255,70 @@ int files_cmp (FILE *f1, FILE *f2) {
 
 #endif
 
-void *gc_alloc_on_existing_heap (size_t size) {
-  if (heap.current + size <= heap.end) {
-    void *p = (void *)heap.current;
-    heap.current += size;
+static void *chunk_alloc (memory_chunk *chunk, size_t size) {
+  if (chunk->current + size <= chunk->end) {
+    void *p = (void *)chunk->current;
+    chunk->current += size;
     memset(p, 0, size * sizeof(size_t));
     return p;
   }
   return NULL;
 }
 
+void *gc_alloc_on_existing_heap (size_t size) { return chunk_alloc(&heap, size); }
+
+// follows a change of the heap size, the bits of the words that stay are kept
+static void resize_mark_bits (size_t old_heap_size) {
+  current_isolate->mark_bits = mremap(current_isolate->mark_bits,
+                                      MARK_BITS_SIZE(old_heap_size),
+                                      MARK_BITS_SIZE(heap.size),
+                                      MREMAP_MAYMOVE);
+  if (current_isolate->mark_bits == MAP_FAILED) {
+    perror("ERROR: resize_mark_bits: mremap failed\n");
+    exit(1);
+  }
+}
+
+// the index of the mark bit of an object is the offset of its header in words
+static inline size_t mark_bit_index (void *obj) { return (size_t *)TO_DATA(obj) - heap.begin; }
+
+// the header of the first marked object in [from, end), or end; scans a word of bits at a time
+static inline size_t *next_marked (size_t *from, size_t *end) {
+  const unsigned *bits = current_isolate->mark_bits;
+  size_t          k = from - heap.begin, n = end - heap.begin;
+  while (k < n) {
+    unsigned word = bits[k / 32] >> k % 32;
+    if (word != 0) { return heap.begin + MIN(k + __builtin_ctz(word), n); }
+    k = (k / 32 + 1) * 32;
+  }
+  return end;
+}
+
+// unmarks the objects in the first words of the heap
+static void clear_mark_bits (size_t words) {
+  memset(current_isolate->mark_bits, 0, MARK_BITS_SIZE(words));
+}
+
+static void reset_remembered_set (void);
+
 void *gc_alloc (size_t size) {
+  collect_heap(size);
+  return gc_alloc_on_existing_heap(size);
+}
+
+// scales the room by how far the last collection was from the target ratio
+static void adapt_heap_room (double now) {
+  heap_policy *policy  = &current_isolate->policy;
+  double       gc_time = policy->gc_time + policy->minor_time;
+  double       program = now - policy->last_end - policy->minor_time;
+  if (gc_time <= 0 || program <= 0) { return; }
+  double scale = MIN(MAX(gc_time / program / policy->time_ratio, 0.5), 2.0);
+  policy->room = MIN(MAX(policy->room * scale, MIN_HEAP_ROOM), MAX_HEAP_ROOM);
+}
+
+void collect_heap (size_t additional_size) {
+  double start = gc_clock();
+  adapt_heap_room(start);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has started\n");
 #endif
@@ -196,7 +332,7 @@ void *gc_alloc (size_t size) {
   FILE *heap_before_compaction = print_objects_traversal("after-mark", 1);
 #endif
 
-  compact_phase(size);
+  compact_phase(additional_size);
 #ifdef FULL_INVARIANT_CHECKS
   FILE *stack_after           = print_stack_content("stack-dump-after-compaction");
   FILE *heap_after_compaction = print_objects_traversal("after-compaction", 0);
@@ -219,16 +355,223 @@ void *gc_alloc (size_t size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has finished\n");
 #endif
+  // the remembered set is empty, but the heap could be resized
+  if (nursery.begin != NULL) { reset_remembered_set(); }
+  current_isolate->policy.last_end   = gc_clock();
+  current_isolate->policy.gc_time    = current_isolate->policy.last_end - start;
+  current_isolate->policy.minor_time = 0;
+}
+
+static void reset_remembered_set (void) {
+  free(remembered.bits);
+  remembered.bits = calloc((heap.size + 31) / 32, sizeof(unsigned));
+  if (remembered.bits == NULL) {
+    perror("ERROR: reset_remembered_set: calloc failed\n");
+    exit(1);
+  }
+  remembered.n = 0;
+}
+
+static void out_of_memory (size_t words) {
+  fprintf(stderr,
+          "ERROR: out of memory: %zu words do not fit the heap limit of %zu words\n",
+          words,
+          current_isolate->policy.maximum);
+  exit(1);
+}
+
+// gives the empty heap a new size, it can move as there are no objects yet
+static void reset_heap (size_t words) {
+  if (words > current_isolate->policy.maximum) { out_of_memory(words); }
+  heap.begin = mremap(heap.begin, WORDS_TO_BYTES(heap.size), WORDS_TO_BYTES(words), MREMAP_MAYMOVE);
+  if (heap.begin == MAP_FAILED) {
+    perror("ERROR: reset_heap: mremap failed\n");
+    exit(1);
+  }
+  size_t old_size = heap.size;
+  heap.end        = heap.begin + words;
+  heap.size       = words;
+  heap.current    = heap.begin;
+  resize_mark_bits(old_size);
+  if (nursery.begin != NULL) { reset_remembered_set(); }
+}
+
+void gc_set_heap_size (size_t initial, size_t minimum, size_t maximum) {
+  heap_policy *policy = &current_isolate->policy;
+  if (maximum != 0) { policy->maximum = MAX(maximum, MINIMUM_HEAP_CAPACITY); }
+  if (minimum != 0) {
+    policy->minimum = MAX(minimum, MINIMUM_HEAP_CAPACITY);
+  } else if (initial != 0) {
+    // as in isolate_create, a smaller initial size lowers the minimum with it
+    policy->minimum = MIN(policy->minimum, MAX(initial, MINIMUM_HEAP_CAPACITY));
+  }
+  if (initial != 0) { policy->initial = initial; }
+  policy->minimum = MIN(policy->minimum, policy->maximum);
+  policy->initial = MIN(MAX(policy->initial, policy->minimum), policy->maximum);
+  if (heap.current == heap.begin) {
+    // a generational heap keeps room to promote the whole nursery
+    reset_heap(MAX(policy->initial, nursery.size * EXTRA_ROOM_HEAP_COEFFICIENT));
+  }
+}
+
+void gc_set_time_ratio (int percents) { current_isolate->policy.time_ratio = percents / 100.0; }
+
+size_t gc_parse_size (const char *s) {
+  char *end;
+  errno        = 0;
+  size_t bytes = strtoul(s, &end, 10);
+  int    shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+  if (shift != 0) { ++end; }
+  // a size that does not fit into size_t, in bytes, is malformed too
+  if (end == s || *end != 0 || bytes == 0 || errno == ERANGE || *s == '-'
+      || bytes > SIZE_MAX >> shift) {
+    return 0;
+  }
+  return BYTES_TO_WORDS(bytes << shift);
+}
+
+void gc_enable_nursery (size_t words) {
+  if (heap.current != heap.begin || nursery.begin != NULL) {
+    perror("ERROR: gc_enable_nursery: the heap is already in use\n");
+    exit(1);
+  }
+  nursery.begin = mmap(NULL,
+                       WORDS_TO_BYTES(words),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT,
+                       -1,
+                       0);
+  if (nursery.begin == MAP_FAILED) {
+    perror("ERROR: gc_enable_nursery: mmap failed\n");
+    exit(1);
+  }
+  nursery.end     = nursery.begin + words;
+  nursery.size    = words;
+  nursery.current = nursery.begin;
+
+  // the heap gets room to promote the whole nursery
+  reset_heap(MAX(heap.size, words * EXTRA_ROOM_HEAP_COEFFICIENT));
+}
+
+static inline bool is_young_pointer (const size_t *p) {
+  return !UNBOXED(p) && (size_t)nursery.begin < (size_t)p && (size_t)p <= (size_t)nursery.current;
+}
+
+static void remember_slot (size_t **slot) {
+  size_t    k   = (size_t *)slot - heap.begin;
+  unsigned *bit = &remembered.bits[k / 32];
+  if (*bit & (1u << k % 32)) { return; }
+  *bit |= 1u << k % 32;
+  if (remembered.n == remembered.capacity) {
+    remembered.capacity = MAX(2 * remembered.capacity, 64);
+    remembered.slots    = realloc(remembered.slots, remembered.capacity * sizeof(size_t *));
+    if (remembered.slots == NULL) {
+      perror("ERROR: remember_slot: realloc failed\n");
+      exit(1);
+    }
+  }
+  remembered.slots[remembered.n++] = (size_t *)slot;
+}
+
+void gc_write_barrier (void **slot, void *value) {
+  if (is_young_pointer(value) && (size_t *)slot >= heap.begin && (size_t *)slot < heap.current) {
+    remember_slot((size_t **)slot);
+  }
+}
+
+// a large object is allocated in the heap before its fields are initialized
+static void remember_fields (void *obj) {
+  if (nursery.begin == NULL || (size_t *)obj < heap.begin || (size_t *)obj >= heap.current) {
+    return;
+  }
+  for (size_t **slot = get_object_content_ptr(obj); (void *)slot < get_end_of_obj(obj); ++slot) {
+    remember_slot(slot);
+  }
+}
+
+static void *alloc_generational (size_t size) {
+  if (size <= nursery.size / LARGE_OBJECT_FRACTION) {
+    void *p = chunk_alloc(&nursery, size);
+    if (!p) {
+      collect_nursery();
+      p = chunk_alloc(&nursery, size);
+    }
+    return p;
+  }
+  if (heap.current + size + nursery.size > heap.end) {
+    collect_nursery();
+    if (heap.current + size + nursery.size > heap.end) { collect_heap(size + nursery.size); }
+  }
   return gc_alloc_on_existing_heap(size);
 }
 
+// moves a young object to the end of the heap once, the slot is pointed to the copy
+static inline void promote (size_t **slot) {
+  size_t *p = *slot;
+  if (!is_young_pointer(p)) { return; }
+  data *d = TO_DATA(p);
+  if (d->forward_address == 0) {
+    size_t sz = obj_size_header_ptr(d);
+    memcpy(heap.current, d, sz);
+    d->forward_address = (size_t)heap.current;
+    heap.current += BYTES_TO_WORDS(sz);
+  }
+  *slot = get_object_content_ptr((void *)d->forward_address);
+}
+
+void collect_nursery (void) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "===============================minor GC cycle has started\n");
+#endif
+  double  start    = gc_clock();
+  size_t *promoted = heap.current;
+
+  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
+    promote((size_t **)p);
+  }
+  for (int i = 0; i < extra_roots.current_free; ++i) { promote((size_t **)extra_roots.roots[i]); }
+#ifdef LAMA_ENV
+  for (size_t *p = (size_t *)&__start_custom_data; p < (size_t *)&__stop_custom_data; ++p) {
+    promote((size_t **)p);
+  }
+#endif
+  for (size_t i = 0; i < remembered.n; ++i) {
+    size_t k = remembered.slots[i] - heap.begin;
+    remembered.bits[k / 32] &= ~(1u << k % 32);
+    promote((size_t **)remembered.slots[i]);
+  }
+  remembered.n = 0;
+
+  // the promoted objects are scanned in order, which promotes the objects they point to
+  for (size_t *obj = promoted; obj < heap.current;
+       obj += BYTES_TO_WORDS(obj_size_header_ptr(obj))) {
+    for (obj_field_iterator it = ptr_field_begin_iterator(obj); !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      promote((size_t **)it.cur_field);
+    }
+  }
+  nursery.current = nursery.begin;
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "===============================minor GC cycle has finished\n");
+#endif
+  current_isolate->policy.minor_time += gc_clock() - start;
+
+  if (heap.current + nursery.size > heap.end) { collect_heap(nursery.size); }
+}
+
 static void gc_root_scan_stack () {
   for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
     gc_test_and_mark_root((size_t **)p);
   }
 }
 
+static void parallel_mark_phase (int threads_n);
+
 void mark_phase (void) {
+  if (current_isolate->gc_threads > 1 && heap.current - heap.begin >= PARALLEL_GC_MIN_HEAP) {
+    parallel_mark_phase(current_isolate->gc_threads);
+    return;
+  }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "marking has started\n");
   fprintf(stderr,
@@ -255,12 +598,19 @@ void mark_phase (void) {
 #endif
 }
 
-void compact_phase (size_t additional_size) {
-  size_t live_size = compute_locations();
+static void parallel_compact_phase (int threads_n, size_t additional_size);
+
+// the size of the heap after a compaction that leaves live_size words, all in words
+static size_t next_heap_size (size_t live_size, size_t additional_size) {
+  heap_policy *policy = &current_isolate->policy;
+  size_t       needed = live_size + additional_size;
+  if (needed > policy->maximum) { out_of_memory(needed); }
+  double wanted = live_size * (1 + policy->room) + additional_size;
+  return MAX(MAX(needed, policy->minimum), (size_t)MIN(wanted, (double)policy->maximum));
+}
 
-  // all in words
-  size_t next_heap_size =
-      MAX(live_size * EXTRA_ROOM_HEAP_COEFFICIENT + additional_size, MINIMUM_HEAP_CAPACITY);
+// grows the heap before the objects move, the heap may move too; returns it as it was
+static memory_chunk grow_heap (size_t next_heap_size) {
   size_t next_heap_pseudo_size = MAX(next_heap_size, heap.size);
 
   memory_chunk old_heap = heap;
@@ -273,29 +623,54 @@ void compact_phase (size_t additional_size) {
   heap.end     = heap.begin + next_heap_pseudo_size;
   heap.size    = next_heap_pseudo_size;
   heap.current = heap.begin + (old_heap.current - old_heap.begin);
+  resize_mark_bits(old_heap.size);
+  return old_heap;
+}
+
+// shrinks the heap in place after the objects have moved
+static void shrink_heap (size_t next_heap_size) {
+  if (next_heap_size >= heap.size) { return; }
+  if (mremap(heap.begin, WORDS_TO_BYTES(heap.size), WORDS_TO_BYTES(next_heap_size), 0)
+      == MAP_FAILED) {
+    perror("ERROR: shrink_heap: mremap failed\n");
+    exit(1);
+  }
+  size_t old_size = heap.size;
+  heap.end        = heap.begin + next_heap_size;
+  heap.size       = next_heap_size;
+  resize_mark_bits(old_size);
+}
+
+void compact_phase (size_t additional_size) {
+  if (current_isolate->gc_threads > 1 && heap.current - heap.begin >= PARALLEL_GC_MIN_HEAP) {
+    parallel_compact_phase(current_isolate->gc_threads, additional_size);
+    return;
+  }
+  size_t       live_size = compute_locations();
+  size_t       next_size = next_heap_size(live_size, additional_size);
+  memory_chunk old_heap  = grow_heap(next_size);
 
   update_references(&old_heap);
   physically_relocate(&old_heap);
+  clear_mark_bits(old_heap.current - old_heap.begin);
 
   heap.current = heap.begin + live_size;
+  shrink_heap(next_size);
 }
 
 size_t compute_locations () {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC compute_locations started\n");
 #endif
-  size_t       *free_ptr  = heap.begin;
-  heap_iterator scan_iter = heap_begin_iterator();
-
-  for (; !heap_is_done_iterator(&scan_iter); heap_next_obj_iterator(&scan_iter)) {
-    void *header_ptr  = scan_iter.current;
-    void *obj_content = get_object_content_ptr(header_ptr);
-    if (is_marked(obj_content)) {
-      size_t sz = BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
-      // forward address is responsible for object header pointer
-      set_forward_address(obj_content, (size_t)free_ptr);
-      free_ptr += sz;
-    }
+  size_t *free_ptr = heap.begin;
+
+  // no header lies inside an object, so the next one is searched right after the current
+  for (size_t *header_ptr = next_marked(heap.begin, heap.current); header_ptr < heap.current;
+       header_ptr         = next_marked(header_ptr + 1, heap.current)) {
+    size_t sz = BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
+    // forward address is responsible for object header pointer
+    set_forward_address(get_object_content_ptr(header_ptr), (size_t)free_ptr);
+    free_ptr += sz;
   }
 
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
@@ -398,44 +773,46 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #endif
 }
 
-void update_references (memory_chunk *old_heap) {
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "GC update_references started\n");
-#endif
-  heap_iterator it = heap_begin_iterator();
-  while (!heap_is_done_iterator(&it)) {
-    if (is_marked(get_object_content_ptr(it.current))) {
-      for (obj_field_iterator field_iter = ptr_field_begin_iterator(it.current);
-           !field_is_done_iterator(&field_iter);
-           obj_next_ptr_field_iterator(&field_iter)) {
-
-        size_t *field_value = *(size_t **)field_iter.cur_field;
-        if (field_value < old_heap->begin || field_value > old_heap->current) { continue; }
-        // this pointer should also be modified according to old_heap->begin
-        void *field_obj_content_addr =
-            (void *)heap.begin + (*(void **)field_iter.cur_field - (void *)old_heap->begin);
-        // important, we calculate new_addr very carefully here, because objects may relocate to another memory chunk
-        void *new_addr =
-            heap.begin
-            + ((size_t *)get_forward_address(field_obj_content_addr) - (size_t *)old_heap->begin);
-        // update field reference to point to new_addr
-        // since, we want fields to point to an actual content, we need to add this extra content_offset
-        // because forward_address itself is a pointer to the object's header
-        size_t content_offset = get_header_size(get_type_row_ptr(field_obj_content_addr));
+// points the fields of a marked object to the future locations of the objects
+static void fix_fields (memory_chunk *old_heap, void *header) {
+  for (obj_field_iterator field_iter = ptr_field_begin_iterator(header);
+       !field_is_done_iterator(&field_iter);
+       obj_next_ptr_field_iterator(&field_iter)) {
+
+    size_t *field_value = *(size_t **)field_iter.cur_field;
+    if (field_value < old_heap->begin || field_value > old_heap->current) { continue; }
+    // this pointer should also be modified according to old_heap->begin
+    void *field_obj_content_addr =
+        (void *)heap.begin + (*(void **)field_iter.cur_field - (void *)old_heap->begin);
+    // important, we calculate new_addr very carefully here, because objects may relocate to another memory chunk
+    void *new_addr =
+        heap.begin
+        + ((size_t *)get_forward_address(field_obj_content_addr) - (size_t *)old_heap->begin);
+    // update field reference to point to new_addr
+    // since, we want fields to point to an actual content, we need to add this extra content_offset
+    // because forward_address itself is a pointer to the object's header
+    size_t content_offset = get_header_size(get_type_row_ptr(field_obj_content_addr));
 #ifdef DEBUG_VERSION
-        if (!is_valid_heap_pointer((void *)(new_addr + content_offset))) {
+    if (!is_valid_heap_pointer((void *)(new_addr + content_offset))) {
 #  ifdef DEBUG_PRINT
-          fprintf(stderr,
-                  "ur: incorrect pointer assignment: on object with id %d",
-                  TO_DATA(get_object_content_ptr(it.current))->id);
+      fprintf(stderr,
+              "ur: incorrect pointer assignment: on object with id %d",
+              TO_DATA(get_object_content_ptr(header))->id);
 #  endif
-          exit(1);
-        }
-#endif
-        *(void **)field_iter.cur_field = new_addr + content_offset;
-      }
+      exit(1);
     }
-    heap_next_obj_iterator(&it);
+#endif
+    *(void **)field_iter.cur_field = new_addr + content_offset;
+  }
+}
+
+void update_references (memory_chunk *old_heap) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC update_references started\n");
+#endif
+  for (size_t *header_ptr = next_marked(heap.begin, heap.current); header_ptr < heap.current;
+       header_ptr         = next_marked(header_ptr + 1, heap.current)) {
+    fix_fields(old_heap, header_ptr);
   }
   // fix pointers from stack
   scan_and_fix_region(old_heap, (void *)__gc_stack_top + 4, (void *)__gc_stack_bottom + 4);
@@ -452,24 +829,21 @@ void update_references (memory_chunk *old_heap) {
 #endif
 }
 
+// moves a marked object to its forward address, relative to the heap's (possibly new) location
+static inline void relocate_object (memory_chunk *old_heap, size_t *header) {
+  void   *obj = get_object_content_ptr(header);
+  size_t *to  = heap.begin + ((size_t *)get_forward_address(obj) - (size_t *)old_heap->begin);
+  memmove(to, header, obj_size_header_ptr(header));
+}
+
 void physically_relocate (memory_chunk *old_heap) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC physically_relocate started\n");
 #endif
-  heap_iterator from_iter = heap_begin_iterator();
-
-  while (!heap_is_done_iterator(&from_iter)) {
-    void         *obj       = get_object_content_ptr(from_iter.current);
-    heap_iterator next_iter = from_iter;
-    heap_next_obj_iterator(&next_iter);
-    if (is_marked(obj)) {
-      // Move the object from its old location to its new location relative to
-      // the heap's (possibly new) location, 'to' points to future object header
-      size_t *to = heap.begin + ((size_t *)get_forward_address(obj) - (size_t *)old_heap->begin);
-      memmove(to, from_iter.current, obj_size_header_ptr(from_iter.current));
-      unmark_object(get_object_content_ptr(to));
-    }
-    from_iter = next_iter;
+  // the marks are outside the heap, so the objects can be found after the ones before them move
+  for (size_t *header_ptr = next_marked(heap.begin, heap.current); header_ptr < heap.current;
+       header_ptr         = next_marked(header_ptr + 1, heap.current)) {
+    relocate_object(old_heap, header_ptr);
   }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC physically_relocate finished\n");
@@ -477,58 +851,378 @@ void physically_relocate (memory_chunk *old_heap) {
 }
 
 inline bool is_valid_heap_pointer (const size_t *p) {
-  return !UNBOXED(p) && (size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)heap.current;
+  return !UNBOXED(p)
+         && (((size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)heap.current)
+             || is_young_pointer(p));
 }
 
 static inline bool is_valid_pointer (const size_t *p) { return !UNBOXED(p); }
 
-static inline void queue_enqueue (heap_iterator *tail_iter, void *obj) {
-  void *tail         = tail_iter->current;
-  void *tail_content = get_object_content_ptr(tail);
-  set_forward_address(tail_content, (size_t)obj);
-  make_enqueued(obj);
-  heap_next_obj_iterator(tail_iter);
+void gc_set_threads (int n) { current_isolate->gc_threads = MAX(MIN(n, MAX_GC_THREADS), 1); }
+
+typedef struct marker_pool marker_pool;
+
+typedef struct {
+  marker_pool *pool;
+  int          id;
+  mark_deque   deque;
+  size_t     **roots_begin, **roots_end;   // its part of the stack
+} marker;
+
+struct marker_pool {
+  isolate *isolate;
+  int      n;
+  int      idle;   // the threads that found no objects to scan
+  marker   markers[MAX_GC_THREADS];
+};
+
+static void deque_lock (mark_deque *d) {
+  while (__atomic_exchange_n(&d->lock, 1, __ATOMIC_ACQUIRE)) { sched_yield(); }
+}
+
+static void deque_unlock (mark_deque *d) { __atomic_store_n(&d->lock, 0, __ATOMIC_RELEASE); }
+
+static bool deque_is_empty (mark_deque *d) {
+  return __atomic_load_n(&d->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&d->tail, __ATOMIC_ACQUIRE);
+}
+
+static void deque_grow (mark_deque *d) {
+  d->capacity = MAX(2 * d->capacity, 1024);
+  d->items    = realloc(d->items, d->capacity * sizeof(void *));
+  if (d->items == NULL) {
+    perror("ERROR: deque_grow: realloc failed\n");
+    exit(1);
+  }
+}
+
+static void deque_push (mark_deque *d, void *obj) {
+  deque_lock(d);
+  if (d->tail == d->capacity) { deque_grow(d); }
+  d->items[d->tail++] = obj;
+  deque_unlock(d);
+}
+
+// the owner takes the objects it marked last, a thief the ones marked first
+static bool deque_take (mark_deque *d, void **obj, bool steal) {
+  deque_lock(d);
+  bool found = d->head != d->tail;
+  if (found) { *obj = steal ? d->items[d->head++] : d->items[--d->tail]; }
+  if (d->head == d->tail) { d->head = d->tail = 0; }
+  deque_unlock(d);
+  return found;
 }
 
-static inline void *queue_dequeue (heap_iterator *head_iter) {
-  void *head         = head_iter->current;
-  void *head_content = get_object_content_ptr(head);
-  void *value        = (void *)get_forward_address(head_content);
-  make_dequeued(value);
-  heap_next_obj_iterator(head_iter);
-  return value;
+// an object is marked when it is pushed, so it is pushed once; the stack is
+// only touched by the thread that collects, so it needs no lock
+static inline void mark_stack_push (mark_deque *stack, void *obj) {
+  mark_object(obj);
+  if (stack->tail == stack->capacity) { deque_grow(stack); }
+  stack->items[stack->tail++] = obj;
 }
 
 void mark (void *obj) {
   if (!is_valid_heap_pointer(obj) || is_marked(obj)) { return; }
 
-  // TL;DR: [q_head_iter, q_tail_iter) q_head_iter -- current dequeue's victim, q_tail_iter -- place for next enqueue
-  // in forward_address of corresponding element we store address of element to be removed after dequeue operation
-  heap_iterator q_head_iter = heap_begin_iterator();
-  // iterator where we will write address of the element that is going to be enqueued
-  heap_iterator q_tail_iter = q_head_iter;
-  queue_enqueue(&q_tail_iter, obj);
-
-  // invariant: queue contains only objects that are valid heap pointers (each corresponding to content of unmarked
-  // object) also each object is in queue only once
-  while (q_head_iter.current != q_tail_iter.current) {
-    // while the queue is non-empty
-    void *cur_obj = queue_dequeue(&q_head_iter);
-    mark_object(cur_obj);
-    void *header_ptr = get_obj_header_ptr(cur_obj);
-    for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(header_ptr);
+  mark_deque *stack = &current_isolate->mark_stack;
+  mark_stack_push(stack, obj);
+  // invariant: the stack contains only marked objects that are valid heap pointers, each once
+  while (stack->tail != 0) {
+    void *cur_obj = stack->items[--stack->tail];
+    for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(get_obj_header_ptr(cur_obj));
          !field_is_done_iterator(&ptr_field_it);
          obj_next_ptr_field_iterator(&ptr_field_it)) {
       void *field_value = *(void **)ptr_field_it.cur_field;
-      if (!is_valid_heap_pointer(field_value) || is_marked(field_value)
-          || is_enqueued(field_value)) {
-        continue;
+      if (!is_valid_heap_pointer(field_value) || is_marked(field_value)) { continue; }
+      mark_stack_push(stack, field_value);
+    }
+  }
+}
+
+static inline void mark_in_parallel (marker *m, void *obj) {
+  if (!is_valid_heap_pointer(obj) || is_marked(obj)) { return; }
+  size_t   k   = mark_bit_index(obj);
+  unsigned bit = 1u << k % 32;
+  if (__atomic_fetch_or(&current_isolate->mark_bits[k / 32], bit, __ATOMIC_RELAXED) & bit) {
+    return;
+  }
+  deque_push(&m->deque, obj);
+}
+
+static bool steal (marker *m, void **obj) {
+  for (int k = 1; k < m->pool->n; ++k) {
+    mark_deque *victim = &m->pool->markers[(m->id + k) % m->pool->n].deque;
+    if (!deque_is_empty(victim) && deque_take(victim, obj, true)) { return true; }
+  }
+  return false;
+}
+
+// marking is over when all the threads are idle at once: an idle thread has no
+// objects and pushes none
+static bool mark_terminate (marker_pool *pool) {
+  __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+  for (;;) {
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == pool->n) { return true; }
+    for (int k = 0; k < pool->n; ++k) {
+      if (!deque_is_empty(&pool->markers[k].deque)) {
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        return false;
       }
-      // if we came to this point it must be true that field_value is unmarked and not currently in queue
-      // thus, we maintain the invariant
-      queue_enqueue(&q_tail_iter, field_value);
     }
+    sched_yield();
+  }
+}
+
+static void *mark_worker (void *arg) {
+  marker *m = arg;
+  isolate_enter(m->pool->isolate);
+  for (size_t **p = m->roots_begin; p < m->roots_end; ++p) { mark_in_parallel(m, *p); }
+  if (m->id == 0) {
+    for (int i = 0; i < extra_roots.current_free; ++i) {
+      mark_in_parallel(m, *extra_roots.roots[i]);
+    }
+#ifdef LAMA_ENV
+    for (size_t *p = (size_t *)&__start_custom_data; p < (size_t *)&__stop_custom_data; ++p) {
+      mark_in_parallel(m, *(void **)p);
+    }
+#endif
+  }
+  for (;;) {
+    void *obj;
+    if (!deque_take(&m->deque, &obj, false) && !steal(m, &obj)) {
+      if (mark_terminate(m->pool)) { break; }
+      continue;
+    }
+    for (obj_field_iterator it = ptr_field_begin_iterator(get_obj_header_ptr(obj));
+         !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      mark_in_parallel(m, *(void **)it.cur_field);
+    }
+  }
+  return NULL;
+}
+
+// the calling thread is the first marker, it waits for the others
+static void parallel_mark_phase (int threads_n) {
+  marker_pool *pool = calloc(1, sizeof(marker_pool));
+  pthread_t    threads[MAX_GC_THREADS];
+  if (pool == NULL) {
+    perror("ERROR: parallel_mark_phase: calloc failed\n");
+    exit(1);
+  }
+  pool->isolate        = current_isolate;
+  pool->n              = threads_n;
+  size_t **stack_begin = (size_t **)(__gc_stack_top + 4);
+  size_t   stack_n     = (size_t **)__gc_stack_bottom - stack_begin;
+  size_t   chunk       = (stack_n + threads_n - 1) / threads_n;
+  for (int k = 0; k < threads_n; ++k) {
+    pool->markers[k].pool        = pool;
+    pool->markers[k].id          = k;
+    pool->markers[k].roots_begin = stack_begin + MIN(k * chunk, stack_n);
+    pool->markers[k].roots_end   = stack_begin + MIN((k + 1) * chunk, stack_n);
+  }
+  for (int k = 1; k < threads_n; ++k) {
+    if (pthread_create(&threads[k], NULL, mark_worker, &pool->markers[k]) != 0) {
+      perror("ERROR: parallel_mark_phase: pthread_create failed\n");
+      exit(1);
+    }
+  }
+  mark_worker(&pool->markers[0]);
+  for (int k = 1; k < threads_n; ++k) { pthread_join(threads[k], NULL); }
+  for (int k = 0; k < threads_n; ++k) { free(pool->markers[k].deque.items); }
+  free(pool);
+}
+
+typedef struct compactor_pool compactor_pool;
+
+typedef struct {
+  compactor_pool *pool;
+  int             id;
+  size_t         *roots_begin, *roots_end;   // its part of the stack
+} compactor;
+
+// the offsets are in words from the beginning of the heap
+struct compactor_pool {
+  isolate     *isolate;
+  int          n;
+  size_t       additional_size;
+  size_t       used;   // the allocated words before the compaction
+  size_t       regions_n;
+  size_t      *live;     // the live words of each region
+  size_t      *ends;     // the offset where the last live object of each region ends
+  size_t      *dest;     // the offset the live objects of each region slide to
+  int         *moved;    // the regions whose objects are at their destinations
+  size_t       next;     // the next region to take
+  size_t       live_size;
+  size_t       next_size;   // of the heap
+  memory_chunk old_heap;
+  int          arrived, generation;   // the barrier between the steps
+  compactor    compactors[MAX_GC_THREADS];
+};
+
+// the threads take the regions in address order
+static inline size_t take_region (compactor_pool *pool) {
+  return __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+}
+
+static inline size_t *region_begin (size_t k) { return heap.begin + k * HEAP_REGION_SIZE; }
+
+static inline size_t *region_end (compactor_pool *pool, size_t k) {
+  return heap.begin + MIN((k + 1) * HEAP_REGION_SIZE, pool->used);
+}
+
+// each step starts when all the threads have finished the previous one
+static void compactors_barrier (compactor_pool *pool) {
+  int generation = __atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE);
+  if (__atomic_add_fetch(&pool->arrived, 1, __ATOMIC_ACQ_REL) == pool->n) {
+    __atomic_store_n(&pool->arrived, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->generation, generation + 1, __ATOMIC_RELEASE);
+    return;
+  }
+  while (__atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE) == generation) { sched_yield(); }
+}
+
+// the objects of region k move over the live objects of the regions before it that
+// end past its destination; the live objects of the regions follow each other
+static void wait_for_moved (compactor_pool *pool, size_t k) {
+  if (pool->live[k] == 0) { return; }
+  for (size_t j = k; j-- > 0;) {
+    if (pool->live[j] == 0) { continue; }
+    if (pool->ends[j] <= pool->dest[k]) { return; }
+    while (!__atomic_load_n(&pool->moved[j], __ATOMIC_ACQUIRE)) { sched_yield(); }
+  }
+}
+
+static void *compact_worker (void *arg) {
+  compactor      *c    = arg;
+  compactor_pool *pool = c->pool;
+  size_t          k;
+  isolate_enter(pool->isolate);
+
+  // the live words of the regions
+  while ((k = take_region(pool)) < pool->regions_n) {
+    size_t *end = region_end(pool, k);
+    for (size_t *obj = next_marked(region_begin(k), end); obj < end;
+         obj         = next_marked(obj + 1, end)) {
+      size_t sz = BYTES_TO_WORDS(obj_size_header_ptr(obj));
+      pool->live[k] += sz;
+      pool->ends[k] = obj + sz - heap.begin;
+    }
+  }
+  compactors_barrier(pool);
+  if (c->id == 0) {
+    for (k = 0; k < pool->regions_n; ++k) {
+      pool->dest[k] = pool->live_size;
+      pool->live_size += pool->live[k];
+    }
+    pool->next = 0;
+  }
+  compactors_barrier(pool);
+
+  // forward addresses
+  while ((k = take_region(pool)) < pool->regions_n) {
+    size_t *end      = region_end(pool, k);
+    size_t *free_ptr = heap.begin + pool->dest[k];
+    for (size_t *obj = next_marked(region_begin(k), end); obj < end;
+         obj         = next_marked(obj + 1, end)) {
+      set_forward_address(get_object_content_ptr(obj), (size_t)free_ptr);
+      free_ptr += BYTES_TO_WORDS(obj_size_header_ptr(obj));
+    }
+  }
+  compactors_barrier(pool);
+  if (c->id == 0) {
+    pool->next_size = next_heap_size(pool->live_size, pool->additional_size);
+    pool->old_heap  = grow_heap(pool->next_size);
+    pool->next      = 0;
+  }
+  compactors_barrier(pool);
+
+  // references, from the heap and from the roots
+  while ((k = take_region(pool)) < pool->regions_n) {
+    size_t *end = region_end(pool, k);
+    for (size_t *obj = next_marked(region_begin(k), end); obj < end;
+         obj         = next_marked(obj + 1, end)) {
+      fix_fields(&pool->old_heap, obj);
+    }
+  }
+  scan_and_fix_region(&pool->old_heap, c->roots_begin, c->roots_end);
+  if (c->id == 0) {
+    scan_and_fix_region_roots(&pool->old_heap);
+#ifdef LAMA_ENV
+    scan_and_fix_region(
+        &pool->old_heap, (void *)&__start_custom_data, (void *)&__stop_custom_data);
+#endif
+  }
+  compactors_barrier(pool);
+  if (c->id == 0) { pool->next = 0; }
+  compactors_barrier(pool);
+
+  // sliding
+  while ((k = take_region(pool)) < pool->regions_n) {
+    size_t *end = region_end(pool, k);
+    wait_for_moved(pool, k);
+    for (size_t *obj = next_marked(region_begin(k), end); obj < end;
+         obj         = next_marked(obj + 1, end)) {
+      relocate_object(&pool->old_heap, obj);
+    }
+    __atomic_store_n(&pool->moved[k], 1, __ATOMIC_RELEASE);
   }
+  return NULL;
+}
+
+static size_t *compactor_array (size_t n) {
+  size_t *a = calloc(n, sizeof(size_t));
+  if (a == NULL) {
+    perror("ERROR: parallel_compact_phase: calloc failed\n");
+    exit(1);
+  }
+  return a;
+}
+
+// the calling thread is the first compactor, it does the serial steps
+static void parallel_compact_phase (int threads_n, size_t additional_size) {
+  compactor_pool *pool = calloc(1, sizeof(compactor_pool));
+  pthread_t       threads[MAX_GC_THREADS];
+  if (pool == NULL) {
+    perror("ERROR: parallel_compact_phase: calloc failed\n");
+    exit(1);
+  }
+  pool->isolate         = current_isolate;
+  pool->n               = threads_n;
+  pool->additional_size = additional_size;
+  pool->used            = heap.current - heap.begin;
+  pool->regions_n       = (pool->used + HEAP_REGION_SIZE - 1) / HEAP_REGION_SIZE;
+  pool->live            = compactor_array(pool->regions_n);
+  pool->ends            = compactor_array(pool->regions_n);
+  pool->dest            = compactor_array(pool->regions_n);
+  pool->moved           = (int *)compactor_array(pool->regions_n);
+
+  // the stack is fixed up to one word past its bottom, as in update_references
+  size_t *stack_begin = (size_t *)(__gc_stack_top + 4);
+  size_t  stack_n     = (size_t *)(__gc_stack_bottom + 4) - stack_begin;
+  size_t  chunk       = (stack_n + threads_n - 1) / threads_n;
+  for (int k = 0; k < threads_n; ++k) {
+    pool->compactors[k].pool        = pool;
+    pool->compactors[k].id          = k;
+    pool->compactors[k].roots_begin = stack_begin + MIN(k * chunk, stack_n);
+    pool->compactors[k].roots_end   = stack_begin + MIN((k + 1) * chunk, stack_n);
+  }
+  for (int k = 1; k < threads_n; ++k) {
+    if (pthread_create(&threads[k], NULL, compact_worker, &pool->compactors[k]) != 0) {
+      perror("ERROR: parallel_compact_phase: pthread_create failed\n");
+      exit(1);
+    }
+  }
+  compact_worker(&pool->compactors[0]);
+  for (int k = 1; k < threads_n; ++k) { pthread_join(threads[k], NULL); }
+
+  clear_mark_bits(pool->used);
+  heap.current = heap.begin + pool->live_size;
+  shrink_heap(pool->next_size);
+  free(pool->live);
+  free(pool->ends);
+  free(pool->dest);
+  free(pool->moved);
+  free(pool);
 }
 
 void scan_extra_roots (void) {
@@ -560,39 +1254,27 @@ extern void gc_test_and_mark_root (size_t **root) {
 }
 
 void __gc_init (void) {
-  __gc_stack_bottom = (size_t)__builtin_frame_address(1) + 4;
   __init();
+  __gc_stack_bottom = (size_t)__builtin_frame_address(1) + 4;
 }
 
 void __init (void) {
-  signal(SIGSEGV, handler);
-  size_t space_size = INIT_HEAP_SIZE * sizeof(size_t);
+  // the handler is shared by all threads, the one of the first isolate stays
+  struct sigaction sa;
+  if (sigaction(SIGSEGV, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) { signal(SIGSEGV, handler); }
 
   srandom(time(NULL));
 
-  heap.begin = mmap(
-      NULL, space_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
-  if (heap.begin == MAP_FAILED) {
-    perror("ERROR: __init: mmap failed\n");
-    exit(1);
-  }
-  heap.end     = heap.begin + INIT_HEAP_SIZE;
-  heap.size    = INIT_HEAP_SIZE;
-  heap.current = heap.begin;
-  clear_extra_roots();
+  isolate_enter(isolate_create());
 }
 
 extern void __shutdown (void) {
-  munmap(heap.begin, heap.size);
 #ifdef DEBUG_VERSION
   cur_id = 0;
 #endif
-  heap.begin        = NULL;
-  heap.end          = NULL;
-  heap.size         = 0;
-  heap.current      = NULL;
-  __gc_stack_top    = 0;
-  __gc_stack_bottom = 0;
+  isolate *i = current_isolate;
+  isolate_enter(NULL);
+  isolate_destroy(i);
 }
 
 void clear_extra_roots (void) { extra_roots.current_free = 0; }
@@ -683,34 +1365,18 @@ void set_forward_address (void *obj, size_t addr) {
 }
 
 bool is_marked (void *obj) {
-  data *d        = TO_DATA(obj);
-  int   mark_bit = GET_MARK_BIT(d->forward_address);
-  return mark_bit;
+  size_t k = mark_bit_index(obj);
+  return (current_isolate->mark_bits[k / 32] >> k % 32) & 1;
 }
 
 void mark_object (void *obj) {
-  data *d = TO_DATA(obj);
-  SET_MARK_BIT(d->forward_address);
+  size_t k = mark_bit_index(obj);
+  current_isolate->mark_bits[k / 32] |= 1u << k % 32;
 }
 
 void unmark_object (void *obj) {
-  data *d = TO_DATA(obj);
-  RESET_MARK_BIT(d->forward_address);
-}
-
-bool is_enqueued (void *obj) {
-  data *d = TO_DATA(obj);
-  return IS_ENQUEUED(d->forward_address) != 0;
-}
-
-void make_enqueued (void *obj) {
-  data *d = TO_DATA(obj);
-  MAKE_ENQUEUED(d->forward_address);
-}
-
-void make_dequeued (void *obj) {
-  data *d = TO_DATA(obj);
-  MAKE_DEQUEUED(d->forward_address);
+  size_t k = mark_bit_index(obj);
+  current_isolate->mark_bits[k / 32] &= ~(1u << k % 32);
 }
 
 heap_iterator heap_begin_iterator () {
@@ -890,6 +1556,7 @@ void *alloc_array (int len) {
   obj->id = cur_id;
 #endif
   obj->forward_address = 0;
+  remember_fields(obj);
   return obj;
 }
 
@@ -904,6 +1571,7 @@ void *alloc_sexp (int members) {
 #endif
   obj->forward_address = 0;
   obj->tag             = 0;
+  remember_fields(obj);
   return obj;
 }
 
@@ -918,5 +1586,6 @@ void *alloc_closure (int captured) {
   obj->id = cur_id;
 #endif
   obj->forward_address = 0;
+  remember_fields(obj);
   return obj;
 }
@@ -12,8 +12,11 @@
 // not able to allocate memory on the existing heap via simple bump allocator.
 //  - mark_phase(): this function will tell you everything you need to know
 // about marking. I would also recommend to pay attention to the fact that
-// marking is implemented without usage of any additional memory. Already
-// allocated space is sufficient (for details see 'void mark (void *obj)').
+// marking writes nothing into the heap: the mark bits are in a bitmap, a bit per
+// word of the heap, and the objects marked but not scanned yet are on a stack,
+// both kept outside of it (for details see 'void mark (void *obj)'). The
+// compaction finds the live objects by scanning the bitmap, skipping the dead
+// ones.
 //  - void compact_phase (size_t additional_size): the whole compaction phase
 // can be understood by looking at this piece of code plus couple of other
 // functions used in there. It is basically an implementation of LISP2.
@@ -23,18 +26,11 @@
 
 #include "runtime_common.h"
 
-#define GET_MARK_BIT(x) (((int)(x)) & 1)
-#define SET_MARK_BIT(x) (x = (((int)(x)) | 1))
-#define IS_ENQUEUED(x) (((int)(x)) & 2)
-#define MAKE_ENQUEUED(x) (x = (((int)(x)) | 2))
-#define MAKE_DEQUEUED(x) (x = (((int)(x)) & (~2)))
-#define RESET_MARK_BIT(x) (x = (((int)(x)) & (~1)))
-// since last 2 bits are used for mark-bit and enqueued-bit and due to correct
-// alignment we can expect that last 2 bits don't influence address (they
-// should always be zero)
-#define GET_FORWARD_ADDRESS(x) (((size_t)(x)) & (~3))
-// take the last two bits as they are and make all others zero
-#define SET_FORWARD_ADDRESS(x, addr) (x = ((x & 3) | ((int)(addr))))
+// the mark bits are in the bitmap, so the forward address takes the whole word
+#define GET_FORWARD_ADDRESS(x) ((size_t)(x))
+#define SET_FORWARD_ADDRESS(x, addr) (x = (size_t)(addr))
+// the mark bitmap of a heap of the given number of words, in bytes
+#define MARK_BITS_SIZE(words) (((words) + 31) / 32 * sizeof(unsigned))
 // if heap is full after gc shows in how many times it has to be extended
 #define EXTRA_ROOM_HEAP_COEFFICIENT 2
 #ifdef DEBUG_VERSION
@@ -113,6 +109,153 @@ void push_extra_root (void **p);
 void pop_extra_root (void **p);
 
 
+// ============================================================================
+//                              Generations
+// ============================================================================
+// An isolate can be generational. Then objects are bump-allocated in a nursery,
+// and a minor collection empties it by copying the live ones to the end of the
+// heap, where they stay (promotion). The heap itself is still collected by the
+// mark-compact algorithm above, but only right after a minor collection, when
+// the nursery is empty. The heap always keeps room to promote the whole nursery.
+// The roots of a minor collection are the ones of a major collection plus the
+// remembered set: the slots of the heap that may point into the nursery. So
+// every store of a pointer into an existing object must be followed by a call
+// of `gc_write_barrier`. Objects too big for the nursery go right to the heap,
+// all their fields are remembered.
+#define NURSERY_SIZE (1 << 16)   // words, the nursery of `gc_enable_nursery` by default
+// objects bigger than this part of the nursery are allocated in the heap
+#define LARGE_OBJECT_FRACTION 8
+
+typedef struct {
+  size_t  **slots;   // each remembered slot once, it is marked in bits
+  size_t    n, capacity;
+  unsigned *bits;   // a bit per word of the heap
+} remembered_set;
+
+// the objects marked but not scanned yet; the serial `mark` uses it as a stack,
+// a thread of the parallel marking as a deque that others steal from the head
+typedef struct {
+  void  **items;
+  size_t  head, tail, capacity;   // the objects are items[head, tail)
+  int     lock;
+} mark_deque;
+
+// makes the current isolate generational, its heap must be empty
+void gc_enable_nursery (size_t words);
+// records that slot may now point into the nursery, call it after the store
+void gc_write_barrier (void **slot, void *value);
+// the minor collection: promotes the live objects of the nursery to the heap
+void collect_nursery (void);
+// the major collection: marks and compacts the heap
+void collect_heap (size_t additional_size);
+
+
+// ============================================================================
+//                              Heap sizing
+// ============================================================================
+// A collection leaves the heap 1 + `room` times bigger than the live objects,
+// plus the words the allocation asked for, within the minimum and the maximum
+// sizes, so the heap both grows and shrinks. The room adapts to the time the
+// collections take: before a collection it is scaled by the ratio of the time of
+// the last collection and the minor ones after it to the time the program ran
+// after it, divided by the target ratio. Expensive collections thus make the heap sparser and cheap ones
+// make it denser. When the live objects do not fit the maximum size the program
+// stops with an out of memory error. An isolate takes the sizes from the
+// LAMA_HEAP_SIZE (initial), LAMA_HEAP_MIN and LAMA_HEAP_MAX environment variables,
+// in bytes with an optional K, M or G suffix, and the target ratio from
+// LAMA_GC_TIME_RATIO, in percents from 1 to 99. A smaller initial size given
+// alone lowers the default minimum to it.
+#ifdef DEBUG_VERSION
+#  define INITIAL_HEAP_SIZE MINIMUM_HEAP_CAPACITY
+#else
+#  define INITIAL_HEAP_SIZE (1 << 18)   // words, the initial and the minimum size by default
+#endif
+#define GC_TIME_RATIO 5   // percents, the target ratio by default
+#define MIN_HEAP_ROOM 0.25
+#define MAX_HEAP_ROOM 16.0
+
+typedef struct {
+  size_t initial, minimum, maximum;   // words
+  double time_ratio;
+  double room;       // free words per live word after a collection
+  double gc_time;      // seconds the last collection took
+  double minor_time;   // seconds the minor collections took after it
+  double last_end;     // when it ended
+} heap_policy;
+
+// sets the heap sizes of the current isolate in words, 0 keeps a size as it is;
+// an empty heap is given the initial size
+void gc_set_heap_size (size_t initial, size_t minimum, size_t maximum);
+// sets the target ratio of the time in collections to the time between them
+void gc_set_time_ratio (int percents);
+// parses a number of bytes with an optional K, M or G suffix into words, 0 if it is malformed
+size_t gc_parse_size (const char *s);
+
+
+// ============================================================================
+//                            Parallel collection
+// ============================================================================
+// The mark phase of a big heap can run on several threads. The roots on the
+// stack are split between them, and each thread scans the objects it marks with
+// a deque of its own. A thread that runs out of objects steals them from the
+// deques of the others. The mark bits are set atomically, and the serial mark
+// stack of the isolate is not used. An isolate takes the
+// number of threads from the LAMA_GC_THREADS environment variable; 1, the
+// default, keeps the collection serial.
+//
+// The compaction of a big heap is parallel too. The heap is divided into
+// regions of HEAP_REGION_SIZE words, and a region owns the live objects whose
+// headers lie in it, their mark bits tell where they are. The threads take the
+// regions one by one to sum up their live words, a prefix sum of the sums gives
+// the destination of every region, then the threads compute forward addresses
+// and fix references region by region. The objects slide in address order as in
+// the serial LISP2: a region is moved only after the regions whose objects it is
+// moved over, so the order of the objects is kept.
+#define MAX_GC_THREADS 64
+// heaps with fewer allocated words are collected serially, as starting threads costs more
+#define PARALLEL_GC_MIN_HEAP (1 << 18)
+#define HEAP_REGION_SIZE (1 << 16)   // words
+
+// sets the number of threads that collect the heap of the current isolate
+void gc_set_threads (int n);
+
+
+// ============================================================================
+//                              Isolates
+// ============================================================================
+// All the mutable state of the GC and of the runtime belongs to an isolate: the
+// bounds of the Lama stack, the heap, the extra roots and the buffers of the
+// runtime functions. Every thread works on its current isolate, so a process can
+// run independent programs on several threads, each of them with its own heap.
+// An isolate is current on at most one thread at a time, apart from the threads
+// that collect its heap while the owner waits for them.
+typedef struct {
+  size_t           gc_stack_top, gc_stack_bottom;   // first, generated code writes them
+  memory_chunk     heap;
+  memory_chunk     nursery;   // empty unless the isolate is generational
+  remembered_set   remembered;
+  int              gc_threads;
+  heap_policy      policy;
+  unsigned        *mark_bits;   // a bit per word of the heap, set at marked headers
+  mark_deque       mark_stack;   // of the serial marking, kept between collections
+  extra_roots_pool extra_roots;
+  StringBuf        string_buf;
+} isolate;
+
+extern __thread isolate *current_isolate;
+
+// the bounds of the stack of the current isolate
+#define __gc_stack_top (current_isolate->gc_stack_top)
+#define __gc_stack_bottom (current_isolate->gc_stack_bottom)
+
+// creates an isolate with an empty heap, it is not current on any thread
+isolate *isolate_create (void);
+// makes the isolate current on the calling thread, NULL leaves the thread with none
+void isolate_enter (isolate *);
+// frees the memory of an isolate that is not current on any thread
+void isolate_destroy (isolate *);
+
+
 // ============================================================================
 //                   Implemented in GASM: see gc_runtime.s
 // ============================================================================
@@ -121,11 +264,12 @@ void pop_extra_root (void **p);
 void __gc_init (void);
 
 // should be called before interaction with GC in case of using in tests with
-// virtual stack, otherwise it is automatically invoked by `__gc_init`
+// virtual stack, otherwise it is automatically invoked by `__gc_init`;
+// creates an isolate and makes it current on the calling thread
 void __init (void);
 
 // mostly useful for tests but basically you want to call this in case you want
-// to deallocate all object allocated via GC
+// to deallocate all object allocated via GC; destroys the current isolate
 extern void __shutdown (void);
 
 
@@ -180,15 +324,6 @@ void mark_object (void *obj);
 // takes a pointer to an object content as an argument, marks the object as dead
 void unmark_object (void *obj);
 
-// takes a pointer to an object content as an argument, returns whether this object was enqueued to the queue (which is used in mark phase)
-bool is_enqueued (void *obj);
-
-// takes a pointer to an object content as an argument, marks object as enqueued
-void make_enqueued (void *obj);
-
-// takes a pointer to an object content as an argument, unmarks object as enqueued
-void make_dequeued (void *obj);
-
 // returns iterator to an object with the lowest address
 heap_iterator heap_begin_iterator ();
 void          heap_next_obj_iterator (heap_iterator *it);
@@ -7,8 +7,6 @@
 #include "gc.h"
 #include "runtime_common.h"
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
-
 #define PRE_GC()                                                                                   \
   bool flag = false;                                                                               \
   flag      = __gc_stack_top == 0;                                                                 \
@@ -242,9 +240,10 @@ extern int LtagHash (char *s) {
 }
 
 char *de_hash (int n) {
-  static char buf[6] = {0, 0, 0, 0, 0, 0};
-  char       *p      = (char *)BOX(NULL);
-  p                  = &buf[5];
+  // per thread rather than per isolate: LtagHash runs with no isolate at load time
+  static __thread char buf[6] = {0, 0, 0, 0, 0, 0};
+  char                *p      = (char *)BOX(NULL);
+  p                           = &buf[5];
 
   *p-- = 0;
 
@@ -256,13 +255,8 @@ char *de_hash (int n) {
   return ++p;
 }
 
-typedef struct {
-  char *contents;
-  int   ptr;
-  int   len;
-} StringBuf;
-
-static StringBuf stringBuf;
+// the buffer of the current isolate
+#define stringBuf (current_isolate->string_buf)
 
 #define STRINGBUF_INIT 128
 
@@ -740,6 +734,39 @@ extern void *Bstring (void *p) {
   return s;
 }
 
+/* A string literal of the bytecode is built once outside of the heap, so the GC neither
+   marks nor moves it. The literal itself must never be mutated: STRING hands out copies
+   made by Bstring_literal, which knows the length and needs no extra root. */
+extern void *Bliteral (char *p) {
+  int   n   = strlen(p);
+  data *obj = (data *)malloc(string_size(n));
+
+  if (obj == NULL) failure("*** FAILURE: unable to allocate memory.\n");
+
+  obj->data_header = STRING_TAG | (n << 3);
+#ifdef DEBUG_VERSION
+  obj->id = 0;
+#endif
+  obj->forward_address = 0;
+  memcpy(obj->contents, p, n + 1);
+
+  return obj->contents;
+}
+
+extern void *Bstring_literal (void *p) {
+  int   n = LEN(TO_DATA(p)->data_header);
+  void *s = NULL;
+
+  PRE_GC();
+
+  s = LmakeString(BOX(n));
+  memcpy(s, p, n + 1);
+
+  POST_GC();
+
+  return s;
+}
+
 extern void *Lstringcat (void *p) {
   void *s;
 
@@ -877,10 +904,6 @@ extern void *Barray_init_from_end (int bn, const size_t *init) {
   return r->contents;
 }
 
-#ifdef DEBUG_VERSION
-extern memory_chunk heap;
-#endif
-
 extern void *Bsexp (int bn, ...) {
   va_list args;
   int     i;
@@ -1015,14 +1038,17 @@ extern void *Bsta (void *v, int i, void *x) {
       }
       case SEXP_TAG: {
         ((int *)x)[UNBOX(i) + 1] = (int)v;
+        gc_write_barrier(&((void **)x)[UNBOX(i) + 1], v);
         break;
       }
       default: {
         ((int *)x)[UNBOX(i)] = (int)v;
+        gc_write_barrier(&((void **)x)[UNBOX(i)], v);
       }
     }
   } else {
     *(void **)x = v;
+    gc_write_barrier((void **)x, v);
   }
 
   return v;
@@ -1308,7 +1334,12 @@ extern void set_args (int argc, char *argv[]) {
   p = LmakeArray(BOX(n));
   push_extra_root((void **)&p);
 
-  for (i = 0; i < n; i++) { ((int *)p)[i] = (int)Bstring(argv[i]); }
+  for (i = 0; i < n; i++) {
+    // p is read after the allocation, which can move the array
+    void *s       = Bstring(argv[i]);
+    ((int *)p)[i] = (int)s;
+    gc_write_barrier(&((void **)p)[i], s);
+  }
 
   pop_extra_root((void **)&p);
   POST_GC();
@@ -48,8 +48,7 @@ typedef struct {
   size_t id;
 #endif
 
-  // last bit is used as MARK-BIT, the rest are used to store address where object should move
-  // last bit can be used because due to alignment we can assume that last two bits are always 0's
+  // the address where object should move, mark bits are kept in a bitmap of the GC
   size_t forward_address;
   char   contents[0];
 } data;
@@ -63,11 +62,17 @@ typedef struct {
   size_t id;
 #endif
 
-  // last bit is used as MARK-BIT, the rest are used to store address where object should move
-  // last bit can be used because due to alignment we can assume that last two bits are always 0's
+  // the address where object should move, mark bits are kept in a bitmap of the GC
   size_t forward_address;
   int    tag;
   int    contents[0];
 } sexp;
 
+// the buffer the runtime formats strings in, see printStringBuf in runtime.c
+typedef struct {
+  char *contents;
+  int   ptr;
+  int   len;
+} StringBuf;
+
 #endif
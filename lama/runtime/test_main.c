@@ -2,6 +2,7 @@
 #include "runtime_common.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,8 +16,7 @@ extern void *Bsexp (int n, ...);
 extern void *Barray (int bn, ...);
 extern void *Bstring (void *);
 extern void *Bclosure (int bn, void *entry, ...);
-
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern void *Bsta (void *v, int i, void *x);
 
 void test_correct_structure_sizes (void) {
   // something like induction base
@@ -61,6 +61,16 @@ void force_gc_cycle (virt_stack *st) {
   __gc_stack_top = 0;
 }
 
+void force_minor_gc_cycle (virt_stack *st) {
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+  collect_nursery();
+  __gc_stack_top = 0;
+}
+
+bool is_in_chunk (memory_chunk *chunk, size_t p) {
+  return (size_t)chunk->begin < p && p < (size_t)chunk->current;
+}
+
 void test_simple_string_alloc (void) {
   virt_stack *st = init_test();
 
@@ -193,7 +203,201 @@ void test_small_tree_compaction (void) {
   cleanup_test(st);
 }
 
-extern size_t cur_id;
+void test_nursery_promotes_alive (void) {
+  virt_stack *st = init_test();
+  gc_enable_nursery(64);
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "alive"));
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  assert(is_in_chunk(&current_isolate->nursery, vstack_kth_from_start(st, 0)));
+
+  force_minor_gc_cycle(st);
+
+  // only the object on the stack is copied to the heap, the nursery is empty again
+  char *s = (char *)vstack_kth_from_start(st, 0);
+  assert(is_in_chunk(&current_isolate->heap, (size_t)s));
+  assert((strcmp(s, "alive") == 0));
+  assert((current_isolate->nursery.current == current_isolate->nursery.begin));
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 1));
+
+  cleanup_test(st);
+}
+
+void test_remembered_slot_keeps_young_object (void) {
+  virt_stack *st = init_test();
+  gc_enable_nursery(64);
+
+  // the array becomes old, then a young string is stored into it
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), BOX(0)));
+  force_minor_gc_cycle(st);
+  size_t young = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "young");
+  call_runtime_function(
+      vstack_top(st) - 4, Bsta, 3, young, BOX(0), vstack_kth_from_start(st, 0));
+  assert((current_isolate->remembered.n == 1));
+
+  // the string is reachable only through the remembered slot
+  force_minor_gc_cycle(st);
+  char *s = ((char **)vstack_kth_from_start(st, 0))[0];
+  assert(is_in_chunk(&current_isolate->heap, (size_t)s));
+  assert((strcmp(s, "young") == 0));
+  assert((current_isolate->remembered.n == 0));
+
+  cleanup_test(st);
+}
+
+void test_large_object_fields_are_remembered (void) {
+  virt_stack *st = init_test();
+  gc_enable_nursery(64);
+
+  // an array bigger than the nursery allows goes right to the heap with young fields
+  size_t young = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "young");
+  vstack_push(st,
+              call_runtime_function(vstack_top(st) - 4,
+                                    Barray,
+                                    13,
+                                    BOX(12),
+                                    BOX(0),
+                                    BOX(1),
+                                    BOX(2),
+                                    BOX(3),
+                                    BOX(4),
+                                    BOX(5),
+                                    BOX(6),
+                                    BOX(7),
+                                    BOX(8),
+                                    BOX(9),
+                                    BOX(10),
+                                    young));
+  assert(is_in_chunk(&current_isolate->heap, vstack_kth_from_start(st, 0)));
+
+  force_minor_gc_cycle(st);
+  char *s = ((char **)vstack_kth_from_start(st, 0))[11];
+  assert(is_in_chunk(&current_isolate->heap, (size_t)s));
+  assert((strcmp(s, "young") == 0));
+
+  cleanup_test(st);
+}
+
+// a chain of s-expressions, its head on the stack, with a garbage string after every link
+void build_chain (virt_stack *st, int n) {
+  vstack_push(st, BOX(0));
+  for (int k = 0; k < n; ++k) {
+    size_t next = vstack_pop(st);
+    vstack_push(st,
+                call_runtime_function(
+                    vstack_top(st) - 4, Bsexp, 4, BOX(3), BOX(k), next, LtagHash("link")));
+    call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  }
+}
+
+// the links from n - 1 down to first
+void check_chain (virt_stack *st, int n, int first) {
+  int *link = (int *)vstack_kth_from_start(st, 0);
+  for (int k = n - 1; k >= first; --k) {
+    assert((link[1] == BOX(k)));
+    link = (int *)link[2];
+  }
+  assert((link == (int *)BOX(0)));
+}
+
+void test_parallel_mark_of_long_chain (void) {
+  virt_stack *st = init_test();
+  gc_set_threads(4);
+
+  // the heap is big enough to be marked in parallel, the chain is as deep as it is long
+  const int N = PARALLEL_GC_MIN_HEAP / 2;
+  build_chain(st, N);
+  assert((current_isolate->heap.current - current_isolate->heap.begin >= PARALLEL_GC_MIN_HEAP));
+  force_gc_cycle(st);
+  check_chain(st, N, 0);
+
+  int   *ids   = malloc((N + 1) * sizeof(int));
+  size_t alive = objects_snapshot(ids, N + 1);
+  assert((alive == N));
+
+  free(ids);
+  cleanup_test(st);
+}
+
+void test_parallel_compaction_keeps_order (void) {
+  virt_stack *st = init_test();
+  gc_set_threads(4);
+
+  // the older half of the chain dies, so the other half slides down over many regions
+  const int N = PARALLEL_GC_MIN_HEAP / 2;
+  build_chain(st, N);
+  int *link = (int *)vstack_kth_from_start(st, 0);
+  for (int k = N - 1; k > N / 2; --k) { link = (int *)link[2]; }
+  link[2] = BOX(0);
+  force_gc_cycle(st);
+  check_chain(st, N, N / 2);
+
+  int   *ids   = malloc((N + 1) * sizeof(int));
+  size_t alive = objects_snapshot(ids, N + 1);
+  assert((alive == N / 2));
+  for (int i = 0; i < alive - 1; ++i) { assert((ids[i] < ids[i + 1])); }
+  assert((current_isolate->heap.current - current_isolate->heap.begin
+          == alive * BYTES_TO_WORDS(sexp_size(2))));
+
+  free(ids);
+  cleanup_test(st);
+}
+
+// a program of its own on each thread: its isolate keeps a chain on the stack and its name in an
+// extra root through the collections, while the other isolate collects its heap at the same time
+typedef struct {
+  const char *name;
+  int         gc_threads;
+} isolate_program;
+
+void *run_isolate_program (void *arg) {
+  isolate_program *p  = arg;
+  virt_stack      *st = init_test();
+  gc_set_threads(p->gc_threads);
+
+  const int N    = PARALLEL_GC_MIN_HEAP / 2;
+  void     *name = (void *)call_runtime_function(vstack_top(st) - 4, Bstring, 1, p->name);
+  push_extra_root(&name);
+  build_chain(st, N);
+  for (int round = 0; round < 4; ++round) {
+    for (int k = 0; k < 1000; ++k) {
+      call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+    }
+    force_gc_cycle(st);
+    check_chain(st, N, 0);
+    assert((strcmp(name, p->name) == 0));
+    assert((current_isolate->extra_roots.current_free == 1));
+  }
+
+  int   *ids   = malloc((N + 2) * sizeof(int));
+  size_t alive = objects_snapshot(ids, N + 2);
+  assert((alive == N + 1));
+
+  free(ids);
+  pop_extra_root(&name);
+  cleanup_test(st);
+  return NULL;
+}
+
+void test_isolates_on_threads (void) {
+  isolate_program programs[2] = {{"first isolate", 1}, {"second isolate", 4}};
+  pthread_t       threads[2];
+  for (int k = 0; k < 2; ++k) {
+    if (pthread_create(&threads[k], NULL, run_isolate_program, &programs[k]) != 0) {
+      perror("ERROR: test_isolates_on_threads: pthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (int k = 0; k < 2; ++k) { pthread_join(threads[k], NULL); }
+  // the isolates were current on their threads only
+  assert((current_isolate == NULL));
+}
+
+extern __thread size_t cur_id;
 
 size_t generate_random_obj_forest (virt_stack *st, int cnt, int seed) {
   srand(seed);
@@ -262,6 +466,12 @@ int main (int argc, char **argv) {
   test_garbage_is_reclaimed();
   test_alive_are_not_reclaimed();
   test_small_tree_compaction();
+  test_nursery_promotes_alive();
+  test_remembered_slot_keeps_young_object();
+  test_large_object_fields_are_remembered();
+  test_parallel_mark_of_long_chain();
+  test_parallel_compaction_keeps_order();
+  test_isolates_on_threads();
 
   time_t start, end;
   double diff;
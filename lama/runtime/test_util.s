@@ -7,7 +7,8 @@ call_runtime_function:
     pushl %ebp
     movl %esp, %ebp
 
-    # store old stack pointer
+    # store old stack pointer in edi, which is callee-saved, so the caller's one is kept
+    pushl %edi
     movl %esp, %edi
 
     # move esp to point to the virtual stack
@@ -34,6 +35,7 @@ f_call:
 
     # restore the old stack pointer
     movl %edi, %esp
+    popl %edi
 
     # pop the old frame pointer and return
     popl %ebp            # epilogue
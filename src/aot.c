@@ -0,0 +1,679 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lama/runtime/runtime.h"
+#include "builtins.h"
+#include "bytefile.h"
+
+extern int LtagHash(char*);
+
+/*
+Ahead-of-time translator of Lama bytecode to C.
+
+Every function of the bytecode becomes a C function working on an explicit operand
+stack laid out as in the interpreter: arguments and locals are at fixed offsets
+from bp and every value lives in a stack slot, so the GC of the runtime finds and
+moves them as it does under the interpreter. Jumps become gotos, CALL a direct
+call, and CALLC a switch over the entries of all closures of the program.
+
+The result is a single C file to be built with the runtime:
+    lama_aot Sort.bc > Sort.c
+    gcc -m32 -O2 Sort.c gc_helper.s ../lama/runtime/runtime.a -o Sort
+*/
+
+/* What starts at an offset of the bytecode */
+enum {
+    AT_INSN = 1,      /* an instruction */
+    AT_LABEL = 2,     /* the target of a jump */
+    AT_FUNCTION = 4,  /* BEGIN or CBEGIN */
+    AT_CLOSURE = 8,   /* the entry of a closure */
+};
+
+/* A decoded instruction */
+typedef struct {
+    uint8_t op;
+    int32_t a, b;
+    const char* str;         /* the string of STRING, SEXP and TAG, the symbol of CALL_EXTERN */
+    const uint8_t* captures; /* the encoded captures of CLOSURE, b of them */
+} insn_t;
+
+typedef struct {
+    const bytefile* bf;
+    const uint8_t* code;
+    uint8_t* at; /* AT_* flags of every offset */
+    bool has_callc;
+    bool* uses_builtin; /* for every entry of builtins, whether CALL_EXTERN calls it */
+    FILE* out;
+} translator_t;
+
+static int read_int(const translator_t* t, size_t* offset) {
+    if (*offset + sizeof(int) > t->bf->code_size)
+        failure("Truncated bytecode\n");
+    int v;
+    memcpy(&v, t->code + *offset, sizeof(int));
+    *offset += sizeof(int);
+    return v;
+}
+
+static const char* read_string(const translator_t* t, size_t* offset) {
+    int idx = read_int(t, offset);
+    if (idx < 0 || idx >= t->bf->stringtab_size ||
+        memchr(&t->bf->string_ptr[idx], 0, t->bf->stringtab_size - idx) == 0)
+        failure("Invalid string offset 0x%.8x\n", idx);
+    return &t->bf->string_ptr[idx];
+}
+
+// decodes the instruction at the offset and returns the offset of the next one
+static size_t decode_insn(const translator_t* t, size_t offset, insn_t* i) {
+#define FAIL failure("ERROR: invalid opcode %d-%d at 0x%.8zx\n", h, l, offset)
+    uint8_t h = t->code[offset] >> 4, l = t->code[offset] & 0x0F;
+    size_t next = offset + 1;
+    *i = (insn_t){.op = t->code[offset]};
+    switch (h) {
+        case INSTRUCTION_EXIT:
+            break;
+        case INSTRUCTION_BINOP:
+            if (l < 1 || l > 13)
+                FAIL;
+            break;
+        case INSTRUCTION_DATA:
+            if (l == DATA_CONST || l == DATA_JUMP) {
+                i->a = read_int(t, &next);
+            } else if (l == DATA_STRING) {
+                i->str = read_string(t, &next);
+            } else if (l == DATA_SEXP) {
+                i->str = read_string(t, &next);
+                i->b = read_int(t, &next);
+            } else if (l > DATA_ELEM) {
+                FAIL;
+            }
+            break;
+        case INSTRUCTION_LD:
+        case INSTRUCTION_LDA:
+        case INSTRUCTION_ST:
+            if (l > MEM_CLOSED)
+                FAIL;
+            i->a = read_int(t, &next);
+            break;
+        case INSTRUCTION_CONTROL:
+            switch (l) {
+                case CONTROL_CJMPZ:
+                case CONTROL_CJMPNZ:
+                case CONTROL_CALLC:
+                case CONTROL_ARRAY:
+                case CONTROL_LINE:
+                    i->a = read_int(t, &next);
+                    break;
+                case CONTROL_BEGIN:
+                case CONTROL_CBEGIN:
+                case CONTROL_CALL:
+                case CONTROL_FAIL:
+                    i->a = read_int(t, &next);
+                    i->b = read_int(t, &next);
+                    break;
+                case CONTROL_TAG:
+                    i->str = read_string(t, &next);
+                    i->b = read_int(t, &next);
+                    break;
+                case CONTROL_CLOJURE:
+                    i->a = read_int(t, &next);
+                    i->b = read_int(t, &next);
+                    i->captures = t->code + next;
+                    for (int k = 0; k < i->b; k++) {
+                        next++;
+                        read_int(t, &next);
+                    }
+                    break;
+                default:
+                    FAIL;
+            }
+            break;
+        case INSTRUCTION_PATT:
+            if (l > 6)
+                FAIL;
+            break;
+        case INSTRUCTION_CALL:
+            if (l > CALL_EXTERN)
+                FAIL;
+            if (l == CALL_ARRAY)
+                i->a = read_int(t, &next);
+            if (l == CALL_EXTERN) {
+                i->str = read_string(t, &next);
+                i->a = read_int(t, &next);
+            }
+            break;
+        default:
+            FAIL;
+    }
+    return next;
+#undef FAIL
+}
+
+// marks targets of jumps, functions and closure entries
+static void scan_code(translator_t* t) {
+    for (size_t offset = 0; offset < t->bf->code_size;) {
+        insn_t i;
+        t->at[offset] |= AT_INSN;
+        size_t next = decode_insn(t, offset, &i);
+        switch (i.op) {
+            case OPCODE(INSTRUCTION_DATA, DATA_JUMP):
+            case OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPZ):
+            case OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPNZ):
+                if (i.a < 0 || i.a >= t->bf->code_size)
+                    failure("Invalid jump target 0x%.8x\n", i.a);
+                t->at[i.a] |= AT_LABEL;
+                break;
+            case OPCODE(INSTRUCTION_CONTROL, CONTROL_BEGIN):
+            case OPCODE(INSTRUCTION_CONTROL, CONTROL_CBEGIN):
+                t->at[offset] |= AT_FUNCTION;
+                break;
+            case OPCODE(INSTRUCTION_CONTROL, CONTROL_CLOJURE):
+                if (i.a < 0 || i.a >= t->bf->code_size)
+                    failure("Invalid closure entry 0x%.8x\n", i.a);
+                t->at[i.a] |= AT_CLOSURE;
+                break;
+            case OPCODE(INSTRUCTION_CONTROL, CONTROL_CALLC):
+                t->has_callc = true;
+                break;
+            case OPCODE(INSTRUCTION_CALL, CALL_EXTERN): {
+                const builtin_t* f = find_builtin((char*)i.str);
+                if (f == 0)
+                    failure("Unknown external function %s\n", i.str);
+                if (i.a < f->args_n || (i.a > f->args_n && !(f->flags & BUILTIN_VARIADIC)))
+                    failure("Wrong number of arguments of %s at 0x%.8zx\n", i.str, offset);
+                t->uses_builtin[f - builtins] = true;
+                break;
+            }
+        }
+        offset = next;
+    }
+    for (size_t offset = 0; offset < t->bf->code_size; offset++) {
+        if ((t->at[offset] & (AT_LABEL | AT_CLOSURE)) && !(t->at[offset] & AT_INSN))
+            failure("Jump inside of instruction at 0x%.8zx\n", offset);
+        if ((t->at[offset] & AT_CLOSURE) && !(t->at[offset] & AT_FUNCTION))
+            failure("Closure entry 0x%.8zx is not a function\n", offset);
+    }
+}
+
+/* Emission of C */
+
+static void emit_string(translator_t* t, const char* s) {
+    fputc('"', t->out);
+    for (; *s != 0; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(t->out, "\\%c", *s);
+        else if (*s < ' ' || *s > '~')
+            fprintf(t->out, "\\%.3o", (unsigned char)*s);
+        else
+            fputc(*s, t->out);
+    }
+    fputc('"', t->out);
+}
+
+static const char* const prologue =
+    "#include <pthread.h>\n"
+    "#include <signal.h>\n"
+    "#include <stddef.h>\n"
+    "#include <stdint.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "#include <sys/mman.h>\n"
+    "#include <unistd.h>\n"
+    "\n"
+    "#define STACK_SIZE (1 << 20)\n"
+    "/* a Lama call is a C call: the C stack has room for STACK_SIZE of them, and below it is a\n"
+    "   guard larger than any C frame, a fault in which is a stack overflow */\n"
+    "#define NATIVE_FRAME_SIZE 64\n"
+    "#define GUARD_SIZE (1 << 16)\n"
+    "#define BOX(x) ((((size_t)(x)) << 1) | 1)\n"
+    "#define UNBOX(x) (((int32_t)(x)) >> 1)\n"
+    "#define UNBOXED(x) (((size_t)(x)) & 1)\n"
+    "#define GLOBAL(i) memory[STACK_SIZE + (i)]\n"
+    "/* makes the stack visible to the GC, before every call that can allocate */\n"
+    "#define SYNC() (gc->gc_stack_top = (size_t)sp - 4)\n"
+    "\n"
+    "/* the head of isolate in gc.h: the bounds of the stack the GC scans */\n"
+    "typedef struct {\n"
+    "    size_t gc_stack_top, gc_stack_bottom;\n"
+    "} isolate;\n"
+    "extern __thread isolate* current_isolate;\n"
+    "static isolate* gc; /* the isolate of the program, made by __init */\n"
+    "extern void __init(void);\n"
+    "extern void failure(char* s, ...);\n"
+    "extern int Lread();\n"
+    "extern int Lwrite(int n);\n"
+    "extern void* Bstring(void* p);\n"
+    "extern int Llength(void* p);\n"
+    "extern void* Belem(void* p, int i);\n"
+    "extern void* Bsta(void* v, int i, void* x);\n"
+    "extern void* Barray_init_from_end(int bn, const size_t* init);\n"
+    "extern void* Bsexp_init_from_end(int bn, int tag, size_t* init);\n"
+    "extern int Btag(void* d, int t, int n);\n"
+    "extern void* Lstring(void* p);\n"
+    "extern void* Bclosure_init_from_end(int bn, void* entry, size_t* init);\n"
+    "extern int Bstring_patt(void* x, void* y);\n"
+    "extern int Barray_patt(void* d, int n);\n"
+    "extern int Bclosure_tag_patt(void* x);\n"
+    "extern int Bstring_tag_patt(void* x);\n"
+    "extern int Barray_tag_patt(void* x);\n"
+    "extern int Bsexp_tag_patt(void* x);\n"
+    "extern int Bboxed_patt(void* x);\n"
+    "extern int Bunboxed_patt(void* x);\n"
+    "\n";
+
+/* The function being emitted */
+typedef struct {
+    size_t begin, end; /* offsets of BEGIN and of the next function */
+    int args_n;
+    int locals_n;
+    bool is_closure; /* starts with CBEGIN, its closure is under the arguments */
+} function_t;
+
+// a C lvalue of the variable
+static void emit_var(translator_t* t, const function_t* f, MEM mem, int idx) {
+    if (idx < 0)
+        failure("Negative variable index %d\n", idx);
+    switch (mem) {
+        case MEM_GLOBAL:
+            if (idx >= t->bf->global_area_size)
+                failure("Global %d out of bounds\n", idx);
+            fprintf(t->out, "GLOBAL(%d)", idx);
+            break;
+        case MEM_LOCAL:
+            if (idx >= f->locals_n)
+                failure("Local %d out of bounds\n", idx);
+            fprintf(t->out, "bp[%d]", idx - f->locals_n);
+            break;
+        case MEM_ARG:
+            if (idx >= f->args_n)
+                failure("Argument %d out of bounds\n", idx);
+            fprintf(t->out, "bp[%d]", f->args_n - 1 - idx);
+            break;
+        case MEM_CLOSED:
+            // the closure is under the arguments; it is reread as the GC can move it
+            fprintf(t->out, "((size_t*)bp[%d])[%d]", f->args_n, idx + 1);
+            break;
+        default:
+            failure("Invalid variable kind %d\n", mem);
+    }
+}
+
+// a jump must stay in its function: the labels are local to the C function
+static size_t get_label(const translator_t* t, const function_t* f, int target) {
+    if (target < f->begin || target >= f->end)
+        failure("Jump out of the function at 0x%.8zx\n", f->begin);
+    return target;
+}
+
+// the top n values are replaced by the object in r
+static void emit_replace_top(translator_t* t, int n) {
+    if (n != 1)
+        fprintf(t->out, "    sp += %d;\n", n - 1);
+    fprintf(t->out, "    *sp = r;\n");
+}
+
+static void check_call_target(const translator_t* t, int target) {
+    if (target < 0 || target >= t->bf->code_size || !(t->at[target] & AT_FUNCTION))
+        failure("Invalid call target 0x%.8x\n", target);
+}
+
+static bool is_return_at(const translator_t* t, const function_t* f, size_t offset) {
+    return offset < f->end && (t->code[offset] == OPCODE(INSTRUCTION_DATA, DATA_END) ||
+                               t->code[offset] == OPCODE(INSTRUCTION_DATA, DATA_RET));
+}
+
+/*
+CALL or CALLC right before END or RET: the arguments take the place of the ones of
+the function, so the callee leaves the result in the same slot and gcc turns the call
+into a jump. The closure of CALLC takes the place of the closure of the function, so
+only functions that have one, the ones starting with CBEGIN, do that for CALLC.
+*/
+static bool emit_tail_call(translator_t* t, const function_t* f, const insn_t* i) {
+    FILE* out = t->out;
+    if (i->op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL)) {
+        check_call_target(t, i->a);
+        fprintf(out, "    memmove(bp + %d, sp, %d * sizeof(size_t));\n", f->args_n - i->b, i->b);
+        fprintf(out, "    return function_%d(bp + %d);\n", i->a, f->args_n - i->b);
+        return true;
+    }
+    if (i->op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CALLC) && f->is_closure) {
+        fprintf(out, "    r = (size_t)get_closure_function((void*)sp[%d]);\n", i->a);
+        fprintf(out, "    memmove(bp + %d, sp, %d * sizeof(size_t));\n", f->args_n - i->a,
+                i->a + 1);
+        fprintf(out, "    return ((size_t* (*)(size_t*))r)(bp + %d);\n", f->args_n - i->a);
+        return true;
+    }
+    return false;
+}
+
+static void emit_insn(translator_t* t, const function_t* f, const insn_t* i) {
+    static const char* const binops[] = {
+        [1] = "+", [2] = "-", [3] = "*", [4] = "/", [5] = "%", [6] = "<", [7] = "<=",
+        [8] = ">", [9] = ">=", [10] = "==", [11] = "!=", [12] = "&&", [13] = "||",
+    };
+    static const char* const patts[] = {
+        [1] = "Bstring_tag_patt", [2] = "Barray_tag_patt", [3] = "Bsexp_tag_patt",
+        [4] = "Bboxed_patt", [5] = "Bunboxed_patt", [6] = "Bclosure_tag_patt",
+    };
+    FILE* out = t->out;
+    uint8_t h = i->op >> 4, l = i->op & 0x0F;
+    switch (h) {
+        case INSTRUCTION_BINOP:
+            fprintf(out, "    sp[1] = BOX(UNBOX(sp[1]) %s UNBOX(sp[0]));\n    sp++;\n", binops[l]);
+            return;
+        case INSTRUCTION_LD:
+            fprintf(out, "    *--sp = ");
+            emit_var(t, f, l, i->a);
+            fprintf(out, ";\n");
+            return;
+        case INSTRUCTION_LDA:
+            fprintf(out, "    *--sp = (size_t)&");
+            emit_var(t, f, l, i->a);
+            fprintf(out, ";\n");
+            return;
+        case INSTRUCTION_ST:
+            fprintf(out, "    ");
+            emit_var(t, f, l, i->a);
+            fprintf(out, " = *sp;\n");
+            return;
+        case INSTRUCTION_PATT:
+            if (l == 0)
+                fprintf(out, "    r = Bstring_patt((void*)sp[0], (void*)sp[1]);\n    *++sp = r;\n");
+            else
+                fprintf(out, "    *sp = %s((void*)*sp);\n", patts[l]);
+            return;
+        case INSTRUCTION_EXIT:
+            fprintf(out, "    exit(0);\n");
+            return;
+    }
+
+    switch (i->op) {
+        case OPCODE(INSTRUCTION_DATA, DATA_CONST):
+            fprintf(out, "    *--sp = BOX(%d);\n", i->a);
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_STRING):
+            fprintf(out, "    SYNC();\n    r = (size_t)Bstring(");
+            emit_string(t, i->str);
+            fprintf(out, ");\n    *--sp = r;\n");
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_SEXP):
+            fprintf(out, "    SYNC();\n");
+            fprintf(out, "    r = (size_t)Bsexp_init_from_end(BOX(%d), %d, sp);\n", i->b,
+                    LtagHash((char*)i->str));
+            emit_replace_top(t, i->b);
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_STI):
+            fprintf(out, "    *(size_t*)sp[1] = sp[0];\n    sp += 2;\n");
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_STA):
+            fprintf(out,
+                    "    if (UNBOXED(sp[1])) {\n"
+                    "        r = (size_t)Bsta((void*)sp[0], sp[1], (void*)sp[2]);\n"
+                    "        sp += 2;\n"
+                    "    } else {\n"
+                    "        r = (size_t)Bsta((void*)sp[0], sp[1], (void*)sp[1]);\n"
+                    "        sp += 1;\n"
+                    "    }\n"
+                    "    *sp = r;\n");
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_JUMP):
+            fprintf(out, "    goto label_%zu;\n", get_label(t, f, i->a));
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_END):
+        case OPCODE(INSTRUCTION_DATA, DATA_RET):
+            // the return value replaces the arguments, see handle_end of the interpreter
+            fprintf(out, "    bp[%d] = *sp;\n    return bp + %d;\n", f->args_n - 1, f->args_n - 1);
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_DROP):
+            fprintf(out, "    sp++;\n");
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_DUP):
+            fprintf(out, "    sp--;\n    sp[0] = sp[1];\n");
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_SWAP):
+            fprintf(out, "    r = sp[0];\n    sp[0] = sp[1];\n    sp[1] = r;\n");
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_ELEM):
+            fprintf(out, "    r = (size_t)Belem((void*)sp[1], sp[0]);\n    *++sp = r;\n");
+            break;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPZ):
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPNZ):
+            fprintf(out,
+                    "    if (UNBOX(*sp++) %s 0)\n        goto label_%zu;\n",
+                    i->op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPZ) ? "==" : "!=",
+                    get_label(t, f, i->a));
+            break;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_BEGIN):
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CBEGIN):
+            failure("Nested function at 0x%.8zx\n", f->begin);
+            break;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CLOJURE): {
+            size_t offset = 0;
+            for (int k = 0; k < i->b; k++, offset += 1 + sizeof(int)) {
+                int idx;
+                memcpy(&idx, i->captures + offset + 1, sizeof(int));
+                fprintf(out, "    *--sp = ");
+                emit_var(t, f, i->captures[offset], idx);
+                fprintf(out, ";\n");
+            }
+            fprintf(out, "    SYNC();\n");
+            fprintf(out, "    r = (size_t)Bclosure_init_from_end(BOX(%d), (void*)%d, sp);\n", i->b,
+                    i->a);
+            emit_replace_top(t, i->b);
+            break;
+        }
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CALLC):
+            fprintf(out, "    sp = call_closure(sp, %d);\n", i->a);
+            break;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL):
+            check_call_target(t, i->a);
+            fprintf(out, "    sp = function_%d(sp);\n", i->a);
+            break;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_TAG):
+            fprintf(out, "    *sp = Btag((void*)*sp, %d, BOX(%d));\n",
+                    LtagHash((char*)i->str), i->b);
+            break;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_ARRAY):
+            fprintf(out, "    *sp = Barray_patt((void*)*sp, BOX(%d));\n", i->a);
+            break;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_FAIL):
+            fprintf(out, "    failure(\"fail: %d, %d\\n\");\n", i->a, i->b);
+            break;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_LINE):
+            break;
+        case OPCODE(INSTRUCTION_CALL, CALL_READ):
+            fprintf(out, "    r = Lread();\n    *--sp = r;\n");
+            break;
+        case OPCODE(INSTRUCTION_CALL, CALL_WRITE):
+            fprintf(out, "    *sp = Lwrite(*sp);\n");
+            break;
+        case OPCODE(INSTRUCTION_CALL, CALL_LENGTH):
+            fprintf(out, "    *sp = Llength((void*)*sp);\n");
+            break;
+        case OPCODE(INSTRUCTION_CALL, CALL_STRING):
+            fprintf(out, "    r = *sp++;\n    SYNC();\n    r = (size_t)Lstring((void*)r);\n");
+            fprintf(out, "    *--sp = r;\n");
+            break;
+        case OPCODE(INSTRUCTION_CALL, CALL_ARRAY):
+            fprintf(out, "    SYNC();\n    r = (size_t)Barray_init_from_end(BOX(%d), sp);\n", i->a);
+            emit_replace_top(t, i->a);
+            break;
+        case OPCODE(INSTRUCTION_CALL, CALL_EXTERN): {
+            // the arguments stay on the stack during the call, as roots for the GC
+            const builtin_t* f = find_builtin((char*)i->str);
+            fprintf(out, "    SYNC();\n    r = extern_%s(", f->name);
+            for (int k = 0; k < i->a; k++)
+                fprintf(out, k == 0 ? "sp[%d]" : ", sp[%d]", i->a - 1 - k);
+            fprintf(out, ");\n");
+            if (f->flags & BUILTIN_VOID)
+                fprintf(out, "    r = BOX(0);\n");
+            emit_replace_top(t, i->a);
+            break;
+        }
+    }
+}
+
+/*
+A function gets the arguments on the stack and returns the slot of the result,
+which replaces them:
+        <---- sp                         <---- the result
+    args           -> after the call     ...
+    [closure]                            [closure]
+The closure of CALLC is dropped by call_closure.
+*/
+static void emit_function(translator_t* t, const function_t* f) {
+    fprintf(t->out, "static size_t* function_%zu(size_t* sp) {\n", f->begin);
+    fprintf(t->out, "    size_t* bp = sp;\n    size_t r;\n");
+    // an instruction pushes one word at most, CLOSURE pushes its captures before the result
+    insn_t i;
+    size_t frame_size = f->locals_n;
+    for (size_t offset = decode_insn(t, f->begin, &i); offset < f->end;) {
+        offset = decode_insn(t, offset, &i);
+        frame_size += i.op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CLOJURE) && i.b > 0 ? i.b : 1;
+    }
+    fprintf(t->out, "    if (sp - memory < %zu)\n        failure(\"Stack overflow\\n\");\n",
+            frame_size);
+    if (f->locals_n > 0) {
+        fprintf(t->out, "    sp -= %d;\n", f->locals_n);
+        fprintf(t->out, "    for (int i = 0; i < %d; i++)\n        sp[i] = BOX(0);\n", f->locals_n);
+    }
+    size_t offset = decode_insn(t, f->begin, &i);
+    while (offset < f->end) {
+        size_t next = decode_insn(t, offset, &i);
+        if (t->at[offset] & AT_LABEL)
+            fprintf(t->out, "label_%zu:\n", offset);
+        if (!is_return_at(t, f, next) || !emit_tail_call(t, f, &i))
+            emit_insn(t, f, &i);
+        offset = next;
+    }
+    fprintf(t->out, "    failure(\"Control runs off the function at 0x%.8zx\\n\");\n", f->begin);
+    fprintf(t->out, "    return sp;\n}\n\n");
+}
+
+static void emit_program(translator_t* t) {
+    FILE* out = t->out;
+    fprintf(out, "%s#define GLOBALS_N %d\n\n", prologue, t->bf->global_area_size);
+    fprintf(out, "static size_t memory[STACK_SIZE + GLOBALS_N]; /* the stack, then globals */\n\n");
+    for (size_t offset = 0; offset < t->bf->code_size; offset++) {
+        if (t->at[offset] & AT_FUNCTION)
+            fprintf(out, "static size_t* function_%zu(size_t* sp);\n", offset);
+    }
+    // as in the native code, every argument and the result of a function of the runtime is a word
+    for (size_t k = 0; k < builtins_n; k++) {
+        if (t->uses_builtin[k])
+            fprintf(out, "extern size_t extern_%s() __asm__(\"%s\");\n", builtins[k].name,
+                    builtins[k].name);
+    }
+
+    fprintf(out, "\n");
+
+    if (t->has_callc) {
+        fprintf(out, "static size_t* (*get_closure_function(void* closure))(size_t*) {\n");
+        fprintf(out, "    switch ((size_t)Belem(closure, BOX(0))) {\n");
+        for (size_t offset = 0; offset < t->bf->code_size; offset++) {
+            if (t->at[offset] & AT_CLOSURE)
+                fprintf(out, "        case %zu:\n            return function_%zu;\n", offset,
+                        offset);
+        }
+        fprintf(out, "    }\n    failure(\"Unknown closure entry\\n\");\n    return 0;\n}\n\n");
+        fprintf(out, "/* CALLC: the closure is under the arguments, it is dropped with them */\n");
+        fprintf(out, "static size_t* call_closure(size_t* sp, int args_n) {\n");
+        fprintf(out, "    sp = get_closure_function((void*)sp[args_n])(sp);\n");
+        fprintf(out, "    sp[1] = sp[0];\n    return sp + 1;\n}\n\n");
+    }
+
+    for (size_t offset = 0; offset < t->bf->code_size;) {
+        if (!(t->at[offset] & AT_FUNCTION)) {
+            if (offset == 0)
+                failure("The bytecode does not start with a function\n");
+            offset++;
+            continue;
+        }
+        insn_t begin;
+        decode_insn(t, offset, &begin);
+        function_t f = {.begin = offset,
+                        .end = offset + 1,
+                        .args_n = begin.a,
+                        .locals_n = begin.b,
+                        .is_closure = begin.op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CBEGIN)};
+        while (f.end < t->bf->code_size && !(t->at[f.end] & AT_FUNCTION))
+            f.end++;
+        emit_function(t, &f);
+        offset = f.end;
+    }
+
+    // as on_segv of the interpreter: only async-signal-safe calls, other faults go to the runtime
+    fprintf(out,
+            "static uint8_t* native_guard;\n"
+            "static uint8_t signal_stack[1 << 16];\n"
+            "static struct sigaction previous_segv;\n"
+            "\n"
+            "static void on_segv(int sig, siginfo_t* info, void* ucontext) {\n"
+            "    static const char message[] = \"*** FAILURE: Stack overflow\\n\";\n"
+            "    const uint8_t* a = info->si_addr;\n"
+            "    if (native_guard <= a && a < native_guard + GUARD_SIZE) {\n"
+            "        write(STDERR_FILENO, message, sizeof(message) - 1);\n"
+            "        _exit(255);\n"
+            "    }\n"
+            "    sigaction(SIGSEGV, &previous_segv, 0);\n"
+            "}\n"
+            "\n");
+    // two arguments because main's BEGIN 2 0, as in the interpreter; the handler of the
+    // overflow is installed after the one of the runtime, which __init installs, and runs on
+    // a stack of its own, as the C stack is exhausted
+    fprintf(out,
+            "static void* run(void* unused) {\n"
+            "    stack_t alt = {.ss_sp = signal_stack, .ss_size = sizeof(signal_stack)};\n"
+            "    struct sigaction sa = {.sa_sigaction = on_segv, .sa_flags = SA_SIGINFO | SA_ONSTACK};\n"
+            "    __init();\n"
+            "    sigemptyset(&sa.sa_mask);\n"
+            "    if (sigaltstack(&alt, 0) != 0 || sigaction(SIGSEGV, &sa, &previous_segv) != 0)\n"
+            "        failure(\"Unable to handle stack overflows\\n\");\n"
+            "    gc = current_isolate;\n"
+            "    gc->gc_stack_bottom = (size_t)(memory + STACK_SIZE + GLOBALS_N);\n"
+            "    size_t* sp = memory + STACK_SIZE;\n"
+            "    *--sp = BOX(0);\n"
+            "    *--sp = BOX(0);\n"
+            "    SYNC();\n"
+            "    function_0(sp);\n"
+            "    return 0;\n"
+            "}\n"
+            "\n"
+            "int main(int argc, char* argv[]) {\n"
+            "    size_t size = (size_t)STACK_SIZE * NATIVE_FRAME_SIZE;\n"
+            "    pthread_attr_t attr;\n"
+            "    pthread_t thread;\n"
+            "    native_guard = mmap(0, GUARD_SIZE + size, PROT_READ | PROT_WRITE,\n"
+            "                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);\n"
+            "    if (native_guard == MAP_FAILED || mprotect(native_guard, GUARD_SIZE, PROT_NONE) != 0 ||\n"
+            "        pthread_attr_init(&attr) != 0 ||\n"
+            "        pthread_attr_setstack(&attr, native_guard + GUARD_SIZE, size) != 0 ||\n"
+            "        pthread_create(&thread, &attr, run, 0) != 0)\n"
+            "        failure(\"*** FAILURE: unable to allocate memory.\\n\");\n"
+            "    pthread_join(thread, 0);\n"
+            "    return 0;\n"
+            "}\n");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        printf("Usage: %s <file with bytecode>, the C source is written to stdout\n", argv[0]);
+        return 1;
+    }
+    bytefile* bf = read_file(argv[1]);
+    translator_t t = {.bf = bf, .code = (const uint8_t*)bf->code_ptr, .out = stdout};
+    t.at = calloc(bf->code_size + 1, 1);
+    t.uses_builtin = calloc(builtins_n, sizeof(bool));
+    if (t.at == 0 || t.uses_builtin == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    scan_code(&t);
+    emit_program(&t);
+    free(t.at);
+    free(t.uses_builtin);
+    close_file(bf);
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include "builtins.h"
+
+#include <string.h>
+
+#include "../lama/runtime/runtime.h"
+#include "../lama/runtime/runtime_common.h"
+
+/*
+The functions of Std.i that the runtime implements: the symbol, the number of
+arguments and the flags. The functions are called as the native code calls them,
+with every argument and the result in a word, so they are declared here with no
+prototype whatever their types in runtime.c are.
+*/
+#define BUILTINS(X)                                     \
+    X(Lassert, 2, BUILTIN_VARIADIC | BUILTIN_VOID)      \
+    X(LgetEnv, 1, 0)                                    \
+    X(Lsystem, 1, 0)                                    \
+    X(LstringInt, 1, 0)                                 \
+    X(LmakeArray, 1, 0)                                 \
+    X(Lstring, 1, 0)                                    \
+    X(Llength, 1, 0)                                    \
+    X(Lclone, 1, 0)                                     \
+    X(Lhash, 1, 0)                                      \
+    X(Lfst, 1, 0)                                       \
+    X(Lsnd, 1, 0)                                       \
+    X(Lhd, 1, 0)                                        \
+    X(Ltl, 1, 0)                                        \
+    X(LreadLine, 0, 0)                                  \
+    X(Lstringcat, 1, 0)                                 \
+    X(LmatchSubString, 3, 0)                            \
+    X(Lsubstring, 3, 0)                                 \
+    X(Lregexp, 1, 0)                                    \
+    X(LregexpMatch, 3, 0)                               \
+    X(Lsprintf, 1, BUILTIN_VARIADIC)                    \
+    X(LmakeString, 1, 0)                                \
+    X(Lprintf, 1, BUILTIN_VARIADIC | BUILTIN_VOID)      \
+    X(Lfprintf, 2, BUILTIN_VARIADIC | BUILTIN_VOID)     \
+    X(Lfopen, 2, 0)                                     \
+    X(Lfclose, 1, BUILTIN_VOID)                         \
+    X(Lfread, 1, 0)                                     \
+    X(Lfwrite, 2, BUILTIN_VOID)                         \
+    X(Lfexists, 1, 0)                                   \
+    X(Lfailure, 1, BUILTIN_VARIADIC | BUILTIN_VOID)     \
+    X(Lread, 0, 0)                                      \
+    X(Lwrite, 1, 0)                                     \
+    X(Lcompare, 2, 0)                                   \
+    X(Li__Infix_4343, 2, 0)                             \
+    X(Ls__Infix_58, 2, 0)                               \
+    X(Ls__Infix_3333, 2, 0)                             \
+    X(Ls__Infix_3838, 2, 0)                             \
+    X(Ls__Infix_6161, 2, 0)                             \
+    X(Ls__Infix_3361, 2, 0)                             \
+    X(Ls__Infix_6061, 2, 0)                             \
+    X(Ls__Infix_60, 2, 0)                               \
+    X(Ls__Infix_6261, 2, 0)                             \
+    X(Ls__Infix_62, 2, 0)                               \
+    X(Ls__Infix_43, 2, 0)                               \
+    X(Ls__Infix_45, 2, 0)                               \
+    X(Ls__Infix_42, 2, 0)                               \
+    X(Ls__Infix_47, 2, 0)                               \
+    X(Ls__Infix_37, 2, 0)                               \
+    X(Lrandom, 1, 0)                                    \
+    X(Ltime, 0, 0)                                      \
+    X(LkindOf, 1, 0)                                    \
+    X(LcompareTags, 2, 0)                               \
+    X(LflatCompare, 2, 0)                               \
+    X(LtagHash, 1, 0)                                   \
+    X(Luppercase, 1, 0)                                 \
+    X(Llowercase, 1, 0)
+
+#define DECLARE(name, args_n, flags) extern size_t name();
+BUILTINS(DECLARE)
+#undef DECLARE
+
+const builtin_t builtins[] = {
+#define ENTRY(name, args_n, flags) {#name, name, args_n, flags},
+    BUILTINS(ENTRY)
+#undef ENTRY
+};
+
+const size_t builtins_n = sizeof(builtins) / sizeof(builtins[0]);
+
+const builtin_t* find_builtin(const char* name) {
+    for (size_t k = 0; k < builtins_n; k++) {
+        if (strcmp(builtins[k].name, name) == 0)
+            return &builtins[k];
+    }
+    return 0;
+}
+
+size_t call_builtin(const builtin_t* f, const size_t* args, int args_n) {
+#define ARG(k) args[args_n - 1 - (k)]
+    size_t (*fn)() = f->function;
+    size_t r = 0;
+    switch (args_n) {
+        case 0:
+            r = fn();
+            break;
+        case 1:
+            r = fn(ARG(0));
+            break;
+        case 2:
+            r = fn(ARG(0), ARG(1));
+            break;
+        case 3:
+            r = fn(ARG(0), ARG(1), ARG(2));
+            break;
+        case 4:
+            r = fn(ARG(0), ARG(1), ARG(2), ARG(3));
+            break;
+        case 5:
+            r = fn(ARG(0), ARG(1), ARG(2), ARG(3), ARG(4));
+            break;
+        case 6:
+            r = fn(ARG(0), ARG(1), ARG(2), ARG(3), ARG(4), ARG(5));
+            break;
+        case 7:
+            r = fn(ARG(0), ARG(1), ARG(2), ARG(3), ARG(4), ARG(5), ARG(6));
+            break;
+        case 8:
+            r = fn(ARG(0), ARG(1), ARG(2), ARG(3), ARG(4), ARG(5), ARG(6), ARG(7));
+            break;
+        case 9:
+            r = fn(ARG(0), ARG(1), ARG(2), ARG(3), ARG(4), ARG(5), ARG(6), ARG(7), ARG(8));
+            break;
+        case 10:
+            r = fn(ARG(0), ARG(1), ARG(2), ARG(3), ARG(4), ARG(5), ARG(6), ARG(7), ARG(8),
+                   ARG(9));
+            break;
+        default:
+            failure("Too many arguments of %s\n", f->name);
+    }
+    return f->flags & BUILTIN_VOID ? BOX(0) : r;
+#undef ARG
+}
@@ -0,0 +1,34 @@
+#ifndef __LAMA_BUILTINS__
+#define __LAMA_BUILTINS__
+
+#include <stddef.h>
+
+/* The most arguments of CALL_EXTERN, calls with more are rejected at load */
+#define BUILTIN_MAX_ARGS 10
+
+enum {
+    BUILTIN_VARIADIC = 1, /* takes args_n or more arguments                  */
+    BUILTIN_VOID = 2,     /* returns nothing, the call leaves BOX(0) instead */
+};
+
+/* A function of the runtime that the bytecode calls by its symbol with CALL_EXTERN.
+   The symbol is the name of Std.i with the L prefix, as the native compiler calls it */
+typedef struct {
+    const char* name;
+    size_t (*function)();
+    int args_n;
+    int flags;
+} builtin_t;
+
+extern const builtin_t builtins[];
+extern const size_t builtins_n;
+
+/* Finds a function of the runtime by its symbol, 0 if there is none */
+const builtin_t* find_builtin(const char* name);
+
+/* Calls f with the top args_n values of an operand stack growing down: the first
+   argument is the deepest one, at args[args_n - 1]. The caller leaves the values on
+   the stack and makes it visible to the GC, they are roots while the call runs */
+size_t call_builtin(const builtin_t* f, const size_t* args, int args_n);
+
+#endif
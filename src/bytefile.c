@@ -0,0 +1,68 @@
+#include "bytefile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../lama/runtime/runtime.h"
+
+/* Maps a binary bytecode file by name and unpacks it: the tables and the code are
+   used in place, so processes running the same program share its pages */
+bytefile* read_file(char* fname) {
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        failure("%s\n", strerror(errno));
+    }
+    size_t size = st.st_size;
+    const size_t header_size = 3 * sizeof(int);
+    if (size < header_size) {
+        failure("Truncated bytecode file %s\n", fname);
+    }
+    void* mapping = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        failure("%s\n", strerror(errno));
+    }
+    close(fd);
+
+    bytefile* file = (bytefile*)malloc(sizeof(bytefile));
+    if (file == 0) {
+        failure("*** FAILURE: unable to allocate memory.\n");
+    }
+    file->mapping = mapping;
+    file->mapping_size = size;
+
+    const int* header = mapping;
+    file->stringtab_size = header[0];
+    file->global_area_size = header[1];
+    file->public_symbols_number = header[2];
+    // the tables have to fit into the file, the rest of it is the code; the number of publics
+    // is compared before it is multiplied, as the product may not fit into size_t
+    if (file->stringtab_size < 0 || file->global_area_size < 0 ||
+        file->public_symbols_number < 0 ||
+        (size_t)file->public_symbols_number > (size - header_size) / (2 * sizeof(int))) {
+        failure("Invalid header of bytecode file %s\n", fname);
+    }
+    size_t publics_size = (size_t)file->public_symbols_number * 2 * sizeof(int);
+    if ((size_t)file->stringtab_size > size - header_size - publics_size) {
+        failure("Invalid header of bytecode file %s\n", fname);
+    }
+
+    file->public_ptr = (int*)((char*)mapping + header_size);
+    file->string_ptr = (char*)mapping + header_size + publics_size;
+    file->code_ptr = &file->string_ptr[file->stringtab_size];
+    file->code_size = size - header_size - publics_size - file->stringtab_size;
+
+    return file;
+}
+
+/* Unmaps a file read by read_file and frees it */
+void close_file(bytefile* file) {
+    munmap(file->mapping, file->mapping_size);
+    free(file);
+}
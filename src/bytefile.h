@@ -0,0 +1,87 @@
+#ifndef __LAMA_BYTEFILE__
+#define __LAMA_BYTEFILE__
+
+#include <stddef.h>
+
+/* The unpacked representation of bytecode file */
+typedef struct {
+    char* string_ptr;          /* A pointer to the beginning of the string table */
+    int* public_ptr;           /* A pointer to the beginning of publics table    */
+    char* code_ptr;            /* A pointer to the bytecode itself               */
+    size_t code_size;          /* A size of the bytecode                         */
+    int stringtab_size;        /* The size (in bytes) of the string table        */
+    int global_area_size;      /* The size (in words) of global area             */
+    int public_symbols_number; /* The number of public symbols                   */
+    void* mapping;             /* The file mapped read-only, the pointers are into it */
+    size_t mapping_size;
+} bytefile;
+
+/* Opcodes: the high nibble selects an instruction group, the low nibble an instruction in it */
+
+#define OPCODE(h, l) (((h) << 4) | (l))
+
+enum {
+    INSTRUCTION_BINOP = 0,
+    INSTRUCTION_DATA = 1,
+    INSTRUCTION_LD = 2,
+    INSTRUCTION_LDA = 3,
+    INSTRUCTION_ST = 4,
+    INSTRUCTION_CONTROL = 5,
+    INSTRUCTION_PATT = 6,
+    INSTRUCTION_CALL = 7,
+    INSTRUCTION_EXIT = 15,
+};
+
+enum {
+    DATA_CONST = 0,
+    DATA_STRING = 1,
+    DATA_SEXP = 2,
+    DATA_STI = 3,
+    DATA_STA = 4,
+    DATA_JUMP = 5,
+    DATA_END = 6,
+    DATA_RET = 7,
+    DATA_DROP = 8,
+    DATA_DUP = 9,
+    DATA_SWAP = 10,
+    DATA_ELEM = 11,
+};
+
+enum {
+    CONTROL_CJMPZ = 0,
+    CONTROL_CJMPNZ = 1,
+    CONTROL_BEGIN = 2,
+    CONTROL_CBEGIN = 3,
+    CONTROL_CLOJURE = 4,
+    CONTROL_CALLC = 5,
+    CONTROL_CALL = 6,
+    CONTROL_TAG = 7,
+    CONTROL_ARRAY = 8,
+    CONTROL_FAIL = 9,
+    CONTROL_LINE = 10,
+};
+
+enum {
+    CALL_READ = 0,
+    CALL_WRITE = 1,
+    CALL_LENGTH = 2,
+    CALL_STRING = 3,
+    CALL_ARRAY = 4,
+    CALL_EXTERN = 5, /* a function of the runtime by its symbol and the number of arguments */
+};
+
+/* Kinds of variables, the low nibble of LD, LDA and ST and the kind of a CLOSURE capture */
+typedef enum {
+    MEM_GLOBAL = 0,
+    MEM_LOCAL,
+    MEM_ARG,
+    MEM_CLOSED,
+} MEM;
+
+/* Maps a binary bytecode file by name read-only and unpacks it in place */
+bytefile* read_file(char* fname);
+
+/* Releases a file returned by read_file */
+void close_file(bytefile* file);
+
+#endif
@@ -1,13 +1,22 @@
 
 #include <errno.h>
+#include <fcntl.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "../lama/runtime/gc.h"
 #include "../lama/runtime/runtime.h"
 #include "../lama/runtime/runtime_common.h"
+#include "builtins.h"
+#include "bytefile.h"
 
 #define TODO(what)                           \
     do                                       \
@@ -29,7 +38,8 @@
 /*  Lama runtime functions  */
 extern int Lread();
 extern int Lwrite(int n);
-extern void* Bstring(void* p);
+extern void* Bliteral(char* p);
+extern void* Bstring_literal(void* p);
 extern int Llength(void* p);
 extern void* Belem(void* p, int i);
 extern void* Bsta(void* v, int i, void* x);
@@ -48,122 +58,225 @@ extern int Bsexp_tag_patt(void* x);
 extern int Bboxed_patt(void* x);
 extern int Bunboxed_patt(void* x);
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+/* Words of the operand stack and records of the call stack unless --stack-size=N is given */
+#define STACK_SIZE (1 << 20)
 
-/* The unpacked representation of bytecode file */
-typedef struct {
-    char* string_ptr;          /* A pointer to the beginning of the string table */
-    int* public_ptr;           /* A pointer to the beginning of publics table    */
-    char* code_ptr;            /* A pointer to the bytecode itself               */
-    size_t code_size;          /* A size of the bytecode                         */
-    int stringtab_size;        /* The size (in bytes) of the string table        */
-    int global_area_size;      /* The size (in words) of global area             */
-    int public_symbols_number; /* The number of public symbols                   */
-    char buffer[0];
-} bytefile;
+/* Calls of a function after which it is translated to the register tier, 0 disables the tier */
+#ifndef REG_TIER_THRESHOLD
+#define REG_TIER_THRESHOLD 100
+#endif
 
-#define STACK_SIZE (1 << 20)
+/* Functions are compiled to machine code on their first call unless --no-jit is given.
+   The templates are i386 code, on other targets the program is always interpreted. */
+#if defined(__i386__) && !defined(PROFILE_SEQUENCES)
+#define HAS_JIT
+#endif
 
 typedef struct {
     size_t* p;
     size_t n;
 } slice_t;
 
+typedef struct insn insn_t;
+
+/* An operand of a pre-decoded instruction */
+typedef union {
+    int32_t n;
+    insn_t* target; /* resolved jump or call target */
+    char* str;      /* resolved string table entry */
+    void* ptr;
+} operand_t;
+
+/* A variable captured by CLOSURE */
 typedef struct {
-    uint8_t* p;
-    size_t n;
-} byte_slice_t;
+    MEM mem;
+    int idx;
+} capture_t;
+
+/* A pre-decoded instruction: the bytecode is translated into a stream of these
+   fixed-width records once at load time, so handlers never decode operands */
+struct insn {
+    const void* handler; /* address of the handler, set when the stream is threaded */
+    uint16_t op;         /* opcode, or a superinstruction number above 0xFF */
+    uint16_t sub;        /* low nibble of the opcode: binary operation or memory kind */
+    operand_t a, b, c;
+};
 
 typedef struct {
-    char* p;
+    insn_t* p;
     size_t n;
-} char_slice_t;
+} insn_slice_t;
+
+/* Records generated at run time: functions of the register tier and exits of the JIT */
+typedef struct code_block {
+    insn_slice_t code;
+    struct code_block* next;
+} code_block_t;
 
+/* An arm of a case chain: a pattern that the top value is tested against */
 typedef struct {
-    size_t* begin;
-    size_t* sp;
+    int kind;        /* SEXP_TAG, ARRAY_TAG or STRING_TAG, 0 in an empty slot */
+    int32_t tag;     /* the tag of a sexp or the hash of a string                */
+    int32_t n;       /* the number of elements of a sexp or an array              */
+    const char* str; /* the string of a string pattern                           */
+    insn_t* target;  /* the body of the arm                                       */
+} case_arm_t;
+
+/* A chain of DUP; test; CJMPZ arms of a case, compiled into a hash table of its arms */
+typedef struct case_table {
+    struct case_table* next;
+    insn_t* miss;     /* where control goes when no arm matches                  */
+    bool has_strings; /* string patterns fail on values of other kinds           */
+    size_t mask;      /* the number of slots minus one                           */
+    case_arm_t arms[];
+} case_table_t;
+
+typedef struct jit jit_t;
+
+/* The records from insn on come from the line, up to the next entry */
+typedef struct {
+    uint32_t insn; /* index in the instruction stream                         */
+    int32_t line;
+} line_entry_t;
+
+/* The pre-decoded program */
+typedef struct {
+    insn_slice_t code;       /* instruction stream, terminated by an EXIT record */
+    int32_t* insn_of_offset; /* bytecode offset -> index in code, -1 inside of an instruction */
+    size_t code_size;        /* size of the original bytecode                   */
+    capture_t* captures;     /* operands of all CLOSURE instructions            */
+    size_t captures_n;
+    void** literals;         /* strings of all STRING instructions, outside of the heap */
+    size_t literals_n;
+    line_entry_t* lines;     /* operands of LINE by position, LINE is not in the stream */
+    size_t lines_n;
+    int global_area_size;    /* The size (in words) of global area              */
+    size_t max_frame;        /* stack slots of the largest frame: locals and operands */
+    code_block_t* code_blocks; /* records generated at run time                   */
+    case_table_t* case_tables; /* tables of the compiled case chains              */
+    jit_t* jit;                /* compiled code, 0 if the JIT is off              */
+    void* image;               /* the mapped image holding the records, see load_image */
+    size_t image_size;
+} program_t;
+
+/* Saved state of the caller: pushed by CALL and CALLC, popped by END */
+typedef struct {
+    insn_t* ip; /* return address */
+    size_t* bp;
+    int32_t args_n;
+    int32_t locals_n;
+    bool is_closure;
+} frame_t;
+
+/* The largest --stack-size: the bytes of either stack, with the globals, fit into size_t */
+#define MAX_STACK_SIZE (SIZE_MAX / sizeof(frame_t))
+
+typedef struct {
+    frame_t* begin;
+    frame_t* fp; /* the innermost frame */
     size_t n;
-} stack_t;
+} frame_stack_t;
 
+/* The state of a running program. The program, its stacks and its heap belong to one
+   isolate of the runtime, so programs in other isolates can run on other threads */
 typedef struct {
+    isolate* isolate; /* current on the thread while the program runs */
     slice_t stack;
-    stack_t cstack;
-    slice_t args;
-    slice_t locals;
-    slice_t closed;
+    frame_stack_t frames;
+    int32_t args_n;   /* arguments of the current function, they are above bp */
+    int32_t locals_n; /* locals of the current function, they are below bp    */
     slice_t globals;
-    byte_slice_t code;
-    char_slice_t string_area;
-    uint8_t* ip;
+    insn_slice_t code;
+    program_t* program;
+    insn_t* ip;
+    size_t* sp;
+    size_t tos;
     size_t* bp;
     bool is_closure;
 } context_t;
 
 /* Context functions */
 
-static inline char* get_string(context_t* c, int idx) {
-    ASSERT(0 <= idx && idx < c->string_area.n, "Out of bounds string area");
-    return &c->string_area.p[idx];
+// instructions live either in the program stream or in blocks generated at run time
+static inline bool is_code_address(context_t* c, const insn_t* i) {
+    if (c->code.p <= i && i < c->code.p + c->code.n)
+        return true;
+    for (code_block_t* b = c->program->code_blocks; b != 0; b = b->next) {
+        if (b->code.p <= i && i < b->code.p + b->code.n)
+            return true;
+    }
+    return false;
 }
 
-static inline void set_ip(context_t* c, uint8_t* to) {
-    ASSERT(c->code.p <= to && to < c->code.p + c->code.n, "Out of bounds bytecode");
+static inline void set_ip(context_t* c, insn_t* to) {
+    ASSERT(is_code_address(c, to), "Out of bounds bytecode");
     c->ip = to;
 }
 
-static inline int next_code_int(context_t* c) {
-    ASSERT(c->ip + sizeof(int) < c->code.p + c->code.n, "Out of bounds bytecode");
-    int v = *(int*)c->ip;
-    c->ip += sizeof(int);
-    return v;
+// return current instruction and move ip to the next one
+static inline insn_t* next_insn(context_t* c) {
+    ASSERT(is_code_address(c, c->ip), "Out of bounds bytecode");
+    return c->ip++;
 }
 
-static inline uint8_t next_code_byte(context_t* c) {
-    ASSERT(c->ip + 1 < c->code.p + c->code.n, "Out of bounds bytecode");
-    uint8_t v = *c->ip;
-    c->ip++;
-    return v;
+static inline insn_t* get_insn_at_offset(context_t* c, size_t offset) {
+    ASSERT(offset < c->program->code_size, "Out of bounds bytecode");
+    int32_t idx = c->program->insn_of_offset[offset];
+    ASSERT(idx >= 0, "Offset inside of instruction");
+    return &c->code.p[idx];
 }
 
-static inline size_t* get_stack_sp() { return (size_t*)(__gc_stack_top + 4); }
+/*
+The operand stack is cached: c->sp points to the top slot and c->tos holds the
+top value, which is not necessarily written to its slot. The stack top of the
+isolate is updated only by sync_stack, before calls that can run the GC, so both the
+pointer and the top value stay in registers across handlers.
+*/
 
-static inline void set_stack_sp(context_t* c, const size_t* to) {
-    ASSERT(c->stack.p <= to, "Overflow stack");
-    ASSERT(to <= c->stack.p + c->stack.n, "Underflow stack");
+static inline size_t* get_stack_sp(context_t* c) { return c->sp; }
 
-    __gc_stack_top = (size_t)to - 4;
-}
+// write the cached top back to its slot, after that the slot can be read through a pointer
+static inline void flush_stack_top(context_t* c) { *c->sp = c->tos; }
 
-static inline void* get_closure_from_stack(context_t* c) {
-    ASSERT(c->is_closure, "not in closure");
-    return (void*)c->args.p[1];
+// make the stack visible to the GC: must be called before anything that can allocate
+static inline void sync_stack(context_t* c) {
+    flush_stack_top(c);
+    c->isolate->gc_stack_top = (size_t)c->sp - 4;
 }
 
-static inline void init_closed(context_t* c) {
-    void* closure = get_closure_from_stack(c);
-    c->closed.n = LEN(TO_DATA(closure)->data_header) - 1;
-    c->closed.p = (size_t*)closure + 1;
-}
+// reread the top after the GC or a write through a pointer could have changed its slot
+static inline void reload_stack_top(context_t* c) { c->tos = *c->sp; }
 
-static inline size_t get_stack_size(context_t* c) { return c->stack.p + c->stack.n - get_stack_sp(); }
+// the closure is above the arguments, captured variables follow its code offset
+static inline size_t* get_closure_from_stack(context_t* c) {
+    ASSERT(c->is_closure, "not in closure");
+    return (size_t*)c->bp[c->args_n];
+}
 
 // move sp and write value
 static inline void push_stack(context_t* c, size_t v) {
-    ASSERT(c->stack.p <= (size_t*)__gc_stack_top, "Overflow stack");
-    *((size_t*)__gc_stack_top) = v;
-    __gc_stack_top -= 4;
+    ASSERT(c->stack.p < c->sp, "Overflow stack");
+    flush_stack_top(c);
+    c->sp--;
+    c->tos = v;
 }
 
 static inline void push_stack_boxed(context_t* c, size_t v) { push_stack(c, BOX(v)); }
 
 // read value and move sp
 static inline size_t pop_stack(context_t* c) {
-    ASSERT((size_t*)__gc_stack_top < c->stack.p + c->stack.n, "Underflow stack");
-    __gc_stack_top += 4;
-    return *((size_t*)__gc_stack_top);
+    ASSERT(c->sp + 1 < c->stack.p + c->stack.n, "Underflow stack");
+    size_t v = c->tos;
+    c->sp++;
+    reload_stack_top(c);
+    return v;
 }
 
-static inline void drop_stack_n(context_t* c, size_t n) { set_stack_sp(c, get_stack_sp() + n); }
+static inline void drop_stack_n(context_t* c, size_t n) {
+    ASSERT(c->sp + n < c->stack.p + c->stack.n, "Underflow stack");
+    c->sp += n;
+    reload_stack_top(c);
+}
 
 static inline size_t pop_stack_unboxed(context_t* c) {
     size_t v = pop_stack(c);
@@ -171,37 +284,28 @@ static inline size_t pop_stack_unboxed(context_t* c) {
     return UNBOX(v);
 }
 
-static inline size_t is_stack_empty(context_t* c) { return get_stack_size(c) == 0; }
-
 static inline size_t peek_stack_i(context_t* c, size_t i) {
-    size_t* p = get_stack_sp() + i;
+    size_t* p = c->sp + i;
     ASSERT(c->stack.p < p && p < c->stack.p + c->stack.n, "Out of bounds stack");
-    return *p;
+    return i == 0 ? c->tos : *p;
 }
 
-static inline size_t peek_stack(context_t* c) { return peek_stack_i(c, 0); }
+static inline size_t peek_stack(context_t* c) { return c->tos; }
 
-// move sp and write value
-static inline void push_cstack(context_t* c, size_t v) {
-    ASSERT(c->cstack.sp >= c->cstack.begin + sizeof(size_t), "Overflow cstack");
-    c->cstack.sp--;
-    *c->cstack.sp = v;
+static inline bool is_stack_bottom(context_t* c, const size_t* sp) {
+    return sp == c->stack.p + c->stack.n;
 }
 
-// read value and move sp
-static inline size_t pop_cstack(context_t* c) {
-    ASSERT(c->cstack.sp < c->cstack.begin + c->cstack.n, "Underflow cstack");
-    size_t v = *c->cstack.sp;
-    c->cstack.sp++;
-    return v;
+// save the state of the caller, ip is the return address
+static inline void push_frame(context_t* c) {
+    ASSERT(c->frames.fp > c->frames.begin, "Overflow call stack");
+    *--c->frames.fp = (frame_t){c->ip, c->bp, c->args_n, c->locals_n, c->is_closure};
 }
 
-typedef enum {
-    MEM_GLOBAL = 0,
-    MEM_LOCAL,
-    MEM_ARG,
-    MEM_CLOSED,
-} MEM;
+static inline frame_t* pop_frame(context_t* c) {
+    ASSERT(c->frames.fp < c->frames.begin + c->frames.n, "Underflow call stack");
+    return c->frames.fp++;
+}
 
 static inline size_t* get_memory(context_t* c, MEM mem, int idx) {
     ASSERT(idx >= 0, "idx < 0");
@@ -210,18 +314,26 @@ static inline size_t* get_memory(context_t* c, MEM mem, int idx) {
             ASSERT(idx < c->globals.n, "idx > c->globals.n");
             return &c->globals.p[idx];
         case MEM_LOCAL:
-            ASSERT(idx < c->locals.n, "idx > c->locals.n");
-            return &c->locals.p[idx];
+            ASSERT(idx < c->locals_n, "idx > c->locals_n");
+            return &c->bp[idx - c->locals_n];
         case MEM_ARG:
-            ASSERT(idx < c->args.n, "idx > c->args.n");
-            return &c->args.p[-idx];
-        case MEM_CLOSED:
-            ASSERT(c->is_closure, "not in closure");
-            ASSERT(idx < c->closed.n, "idx > c->closed.n");
-            return &c->closed.p[idx];
+            ASSERT(idx < c->args_n, "idx > c->args_n");
+            return &c->bp[c->args_n - 1 - idx];
+        case MEM_CLOSED: {
+            size_t* closure = get_closure_from_stack(c);
+            ASSERT(idx < LEN(TO_DATA(closure)->data_header) - 1, "idx > closed n");
+            return &closure[1 + idx];
+        }
     }
 }
 
+// locals and arguments live on the operand stack, the cached top is written back first
+static inline size_t read_memory(context_t* c, MEM mem, int idx) {
+    if (mem == MEM_LOCAL || mem == MEM_ARG)
+        flush_stack_top(c);
+    return *get_memory(c, mem, idx);
+}
+
 /* handlers of instructions */
 
 static inline int32_t do_binop(int32_t x, int32_t y, uint8_t op) {
@@ -271,46 +383,65 @@ static inline int32_t do_binop(int32_t x, int32_t y, uint8_t op) {
 }
 
 static inline void handle_binop(context_t* c, uint8_t l) {
+    next_insn(c);
     int32_t y = UNBOX((int32_t)pop_stack(c));
     int32_t x = UNBOX((int32_t)pop_stack(c));
     int32_t res = do_binop(x, y, l - 1);
     push_stack_boxed(c, res);
 }
 
-static inline void handle_const(context_t* c) { push_stack_boxed(c, next_code_int(c)); }
+static inline void handle_const(context_t* c) { push_stack_boxed(c, next_insn(c)->a.n); }
 
+// b is the literal of the string, the program gets a fresh copy of it
 static inline void handle_string(context_t* c) {
-    int idx = next_code_int(c);
-    char* string = Bstring(get_string(c, idx));
+    sync_stack(c);
+    char* string = Bstring_literal(next_insn(c)->b.ptr);
+    reload_stack_top(c);
     push_stack(c, (size_t)string);
 }
 
+// SEXP and TAG get the hash of their tag at load time in c
 static inline void handle_sexp(context_t* c) {
-    char* tag = get_string(c, next_code_int(c));
-    int n = next_code_int(c);
-    void* sexp = Bsexp_init_from_end(BOX(n), LtagHash(tag), get_stack_sp());
+    insn_t* i = next_insn(c);
+    int n = i->b.n;
+    sync_stack(c);
+    void* sexp = Bsexp_init_from_end(BOX(n), i->c.n, get_stack_sp(c));
     drop_stack_n(c, n);
     push_stack(c, (size_t)sexp);
 }
 
 static inline void handle_sti(context_t* c) {
-    size_t value = pop_stack(c);
-    size_t var = pop_stack(c);
+    next_insn(c);
+    size_t value = c->tos;
+    size_t var = c->sp[1];
+    // the variable can be the slot of the new top, so it is written before the top is reloaded
     *(size_t*)var = value;
+    gc_write_barrier((void**)var, (void*)value);  // the variable can be a captured one
+    drop_stack_n(c, 2);
 }
 
 static inline void handle_sta(context_t* c) {
+    next_insn(c);
     void* value = (void*)pop_stack(c);
     size_t idx_or_var = pop_stack(c);
     void* x = UNBOXED(idx_or_var) ? (void*)pop_stack(c) : (void*)idx_or_var;
-    push_stack(c, (size_t)Bsta(value, idx_or_var, x));
+    void* res = Bsta(value, idx_or_var, x);
+    reload_stack_top(c);  // a variable on the stack could be written
+    push_stack(c, (size_t)res);
 }
 
-static inline void handle_drop(context_t* c) { pop_stack(c); }
+static inline void handle_drop(context_t* c) {
+    next_insn(c);
+    pop_stack(c);
+}
 
-static inline void handle_dup(context_t* c) { push_stack(c, peek_stack(c)); }
+static inline void handle_dup(context_t* c) {
+    next_insn(c);
+    push_stack(c, peek_stack(c));
+}
 
 static inline void handle_swap(context_t* c) {
+    next_insn(c);
     size_t x = pop_stack(c);
     size_t y = pop_stack(c);
     push_stack(c, x);
@@ -318,6 +449,7 @@ static inline void handle_swap(context_t* c) {
 }
 
 static inline void handle_elem(context_t* c) {
+    next_insn(c);
     size_t idx = pop_stack(c);
     void* arr = (void*)pop_stack(c);
     void* elem = Belem(arr, idx);
@@ -325,42 +457,40 @@ static inline void handle_elem(context_t* c) {
 }
 
 static inline void handle_ld(context_t* c, MEM mem) {
-    int idx = next_code_int(c);
-    size_t* var = get_memory(c, mem, idx);
-    push_stack(c, *var);
+    int idx = next_insn(c)->a.n;
+    push_stack(c, read_memory(c, mem, idx));
 }
 
 static inline void handle_lda(context_t* c, MEM mem) {
-    int idx = next_code_int(c);
+    int idx = next_insn(c)->a.n;
     size_t* v = get_memory(c, mem, idx);
     push_stack(c, (size_t)v);
 }
 
 static inline void handle_st(context_t* c, MEM mem) {
-    int idx = next_code_int(c);
+    int idx = next_insn(c)->a.n;
     size_t* var = get_memory(c, mem, idx);
     size_t val = peek_stack(c);
     *var = val;
+    if (mem == MEM_CLOSED)
+        gc_write_barrier((void**)var, (void*)val);
 }
 
 static inline void handle_cjmpz(context_t* c) {
-    int offset = next_code_int(c);
+    insn_t* target = next_insn(c)->a.target;
     size_t cond = pop_stack_unboxed(c);
     if (cond == 0)
-        set_ip(c, c->code.p + offset);
+        set_ip(c, target);
 }
 
 static inline void handle_cjmpnz(context_t* c) {
-    int offset = next_code_int(c);
+    insn_t* target = next_insn(c)->a.target;
     size_t cond = pop_stack_unboxed(c);
     if (cond != 0)
-        set_ip(c, c->code.p + offset);
+        set_ip(c, target);
 }
 
-static inline void handle_jump(context_t* c) {
-    int offset = next_code_int(c);
-    set_ip(c, c->code.p + offset);
-}
+static inline void handle_jump(context_t* c) { set_ip(c, next_insn(c)->a.target); }
 
 /*
 Stack:
@@ -368,10 +498,6 @@ Stack:
     args
     [closure]
 
-Call stack:
-    is_closure_flag
-    return addr
-
 will turn into
 Stack:
         <---- sp
@@ -380,37 +506,18 @@ Stack:
     args
     [closure]
 
-Call stack:
-    prev bp
-    prev locals n
-    prev args n
-    is_closure_flag
-    return addr
-
+The caller's state is already saved by CALL or CALLC, so BEGIN and CBEGIN are the same.
+Captured variables are read through the closure slot, which the GC keeps up to date.
 */
 static inline void handle_begin(context_t* c) {
-    size_t prev_args_n = c->args.n;
-    size_t prev_locals_n = c->locals.n;
-    size_t* prev_bp = c->bp;
-    c->bp = get_stack_sp();
-    c->args.n = next_code_int(c);
-    c->args.p = c->bp + c->args.n - 1;
-    c->locals.n = next_code_int(c);
-    for (int i = 0; i < c->locals.n; i++) {
+    insn_t* i = next_insn(c);
+    flush_stack_top(c);  // arguments and the closure are accessed through pointers
+    c->bp = get_stack_sp(c);
+    c->args_n = i->a.n;
+    c->locals_n = i->b.n;
+    for (int i = 0; i < c->locals_n; i++) {
         push_stack_boxed(c, 0);
     }
-    c->locals.p = get_stack_sp();
-    c->closed.n = 0;
-    c->closed.p = 0;
-
-    push_cstack(c, prev_args_n);
-    push_cstack(c, prev_locals_n);
-    push_cstack(c, (size_t)prev_bp);
-}
-
-static inline void handle_cbegin(context_t* c) {
-    handle_begin(c);
-    init_closed(c);
 }
 
 /*
@@ -422,58 +529,107 @@ Stack:
     args
     [closure]
 
-Call stack:
-    prev bp
-    prev locals n
-    prev args n
-    is_closure_flag
-    return addr
+will turn into the caller's stack with ret val in place of args and the closure
 */
-
 static inline bool handle_end(context_t* c) {
+    next_insn(c);
     size_t ret_value = pop_stack(c);
+    size_t* sp = c->bp + c->args_n;
     if (c->is_closure)
-        drop_stack_n(c, c->args.n + c->locals.n + 1);
-    else
-        drop_stack_n(c, c->args.n + c->locals.n);
-    if (is_stack_empty(c))
+        sp++;
+    if (is_stack_bottom(c, sp))
         return true;  // end from main
-    push_stack(c, ret_value);
-
-    c->bp = (size_t*)pop_cstack(c);
-    c->locals.n = pop_cstack(c);
-    c->args.n = pop_cstack(c);
-    c->is_closure = (bool)pop_cstack(c);
-    set_ip(c, (uint8_t*)pop_cstack(c));
-
-    c->locals.p = c->bp - c->locals.n;
-    c->args.p = c->bp + (c->args.n - 1);
-
-    if (c->is_closure)
-        init_closed(c);
-
+    // the return value replaces the top of the dropped frame
+    c->sp = sp - 1;
+    c->tos = ret_value;
+    *c->sp = ret_value;  // callers in the register tier read it from the slot
+
+    frame_t* f = pop_frame(c);
+    c->bp = f->bp;
+    c->args_n = f->args_n;
+    c->locals_n = f->locals_n;
+    c->is_closure = f->is_closure;
+    set_ip(c, f->ip);
     return false;
 }
 
-static inline void handle_callc(context_t* c) {
-    int args_n = next_code_int(c);
-    void* closure = (void*)peek_stack_i(c, args_n);
-    size_t closure_offset = (size_t)Belem(closure, BOX(0));
-    push_cstack(c, (size_t)(c->ip));
-    push_cstack(c, (size_t)c->is_closure);
+static bool is_function_begin(uint16_t op) {
+    return op == OPCODE(INSTRUCTION_CONTROL, CONTROL_BEGIN) ||
+           op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CBEGIN);
+}
+
+/*
+CALLC is an inline cache: b is the code offset of the last closure called from the
+site and c its CBEGIN record, 0 until the first call. A closure with the same offset
+enters the cached record directly, anything else goes through Belem and the offset table.
+*/
+static inline insn_t* get_callee(context_t* c, insn_t* i) {
+    size_t* closure = (size_t*)peek_stack_i(c, i->a.n);
+    insn_t* callee = i->c.target;
+    if (callee == 0 || UNBOXED((size_t)closure) ||
+        TAG(TO_DATA(closure)->data_header) != CLOSURE_TAG || closure[0] != (size_t)i->b.n) {
+        // the verifier cannot know what is called, so a miss checks it
+        if (UNBOXED((size_t)closure) || TAG(TO_DATA(closure)->data_header) != CLOSURE_TAG)
+            failure("CALLC of a value that is not a closure\n");
+        size_t closure_offset = closure[0];
+        if (closure_offset >= c->program->code_size ||
+            c->program->insn_of_offset[closure_offset] < 0)
+            failure("Invalid closure entry 0x%.8x\n", (int)closure_offset);
+        callee = get_insn_at_offset(c, closure_offset);
+        if (!is_function_begin(callee->op) || callee->a.n != i->a.n)
+            failure("CALLC with %d arguments of a function with %d\n", i->a.n, callee->a.n);
+        i->b.n = closure_offset;
+        i->c.target = callee;
+    }
+    return callee;
+}
 
-    set_ip(c, c->code.p + closure_offset);
+static inline insn_t* handle_callc(context_t* c) {
+    insn_t* callee = get_callee(c, next_insn(c));
+    push_frame(c);
+    set_ip(c, callee);
     c->is_closure = true;
+    return callee;
+}
+
+static inline insn_t* handle_call(context_t* c) {
+    insn_t* target = next_insn(c)->a.target;
+    push_frame(c);
+    set_ip(c, target);
+    c->is_closure = false;
+    return target;
 }
 
-static inline void handle_call(context_t* c) {
-    int offset = next_code_int(c);
-    int args_n = next_code_int(c);
-    push_cstack(c, (size_t)(c->ip));
-    push_cstack(c, (size_t)c->is_closure);
+/*
+Tail calls: CALL or CALLC right before END or RET. The n values on the top, the
+arguments and the closure of CALLC, are moved over the current frame so that the
+callee returns the value to the same slot as the current function would. The frame
+record of the current function stays for the callee, so the stack does not grow.
+*/
+static inline void reuse_frame(context_t* c, int32_t n) {
+    flush_stack_top(c);
+    size_t* top = c->bp + c->args_n - (c->is_closure ? 0 : 1);
+    size_t* from = c->sp;
+    c->sp = top - (n - 1);
+    memmove(c->sp, from, n * sizeof(size_t));
+    reload_stack_top(c);
+}
 
-    set_ip(c, c->code.p + offset);
+static inline insn_t* handle_tail_call(context_t* c) {
+    insn_t* i = next_insn(c);
+    reuse_frame(c, i->b.n);
+    set_ip(c, i->a.target);
     c->is_closure = false;
+    return i->a.target;
+}
+
+static inline insn_t* handle_tail_callc(context_t* c) {
+    insn_t* i = next_insn(c);
+    insn_t* callee = get_callee(c, i);
+    reuse_frame(c, i->a.n + 1);
+    set_ip(c, callee);
+    c->is_closure = true;
+    return callee;
 }
 
 static inline void handle_ret(context_t* c) {
@@ -481,15 +637,16 @@ static inline void handle_ret(context_t* c) {
 }
 
 static inline void handle_clojure(context_t* c) {
-    uint8_t* closure_offset = (uint8_t*)next_code_int(c);
-    int closed_n = next_code_int(c);
+    insn_t* insn = next_insn(c);
+    void* closure_offset = (void*)(size_t)insn->a.n;
+    int closed_n = insn->b.n;
+    const capture_t* captures = insn->c.ptr;
     for (int i = 0; i < closed_n; i++) {
-        MEM mem = (MEM)next_code_byte(c);
-        int idx = next_code_int(c);
-        push_stack(c, *get_memory(c, mem, idx));
+        push_stack(c, read_memory(c, captures[i].mem, captures[i].idx));
     }
 
-    void* closure = Bclosure_init_from_end(BOX(closed_n), closure_offset, get_stack_sp());
+    sync_stack(c);
+    void* closure = Bclosure_init_from_end(BOX(closed_n), closure_offset, get_stack_sp(c));
 
     drop_stack_n(c, closed_n);
 
@@ -498,28 +655,23 @@ static inline void handle_clojure(context_t* c) {
 
 static inline void handle_tag(context_t* c) {
     // check that on stack sexpr with tag and n args
-    char* tag = get_string(c, next_code_int(c));
-    int n = next_code_int(c);
+    insn_t* i = next_insn(c);
+    int n = i->b.n;
     void* x = (void*)pop_stack(c);
-    int res = Btag(x, LtagHash(tag), BOX(n));
+    int res = Btag(x, i->c.n, BOX(n));
     push_stack(c, res);
 }
 
 static inline void handle_array(context_t* c) {
-    int n = next_code_int(c);
+    int n = next_insn(c)->a.n;
     void* x = (void*)pop_stack(c);
     size_t res = Barray_patt(x, BOX(n));
     push_stack(c, res);
 }
 
 static inline void handle_fail(context_t* c) {
-    int x = next_code_int(c);
-    int y = next_code_int(c);
-    failure("fail: %d, %d");
-}
-
-static inline void handle_line(context_t* c) {
-    next_code_int(c);  // ignore
+    insn_t* i = next_insn(c);
+    failure("fail: %d, %d at line %d\n", i->a.n, i->b.n, i->c.n);
 }
 
 static inline size_t do_patt(context_t* c, int op) {
@@ -553,295 +705,3296 @@ static inline size_t do_patt(context_t* c, int op) {
 }
 
 static inline void handle_patt(context_t* c, int l) {
+    next_insn(c);
     size_t res = do_patt(c, l);
     push_stack(c, res);
 }
 
 static inline void handle_call_read(context_t* c) {
+    next_insn(c);
     int v = Lread();
     push_stack(c, v);
 }
 
 static inline void handle_call_write(context_t* c) {
+    next_insn(c);
     int res = Lwrite(pop_stack(c));
     push_stack(c, res);
 }
 
 static inline void handle_call_length(context_t* c) {
+    next_insn(c);
     void* str = (void*)pop_stack(c);
     int size = Llength(str);
     push_stack(c, size);
 }
 
 static inline void handle_call_string(context_t* c) {
+    next_insn(c);
     void* v = (void*)pop_stack(c);
+    sync_stack(c);
     void* str = Lstring(v);
+    reload_stack_top(c);
     push_stack(c, (size_t)str);
 }
 
 static inline void handle_call_array(context_t* c) {
-    int n = next_code_int(c);
-    void* arr = Barray_init_from_end(BOX(n), get_stack_sp());
+    int n = next_insn(c)->a.n;
+    sync_stack(c);
+    void* arr = Barray_init_from_end(BOX(n), get_stack_sp(c));
     drop_stack_n(c, n);
     push_stack(c, (size_t)arr);
 }
 
-/* Disassembles the bytecode pool */
-void disassemble(FILE* f, bytefile* bf) {
-#define FAIL failure("ERROR: invalid opcode %d-%d\n", h, l)
-    const int INSTRUCTION_EXIT = 15;
-    const int INSTRUCTION_BINOP = 0;
-    const int INSTRUCTION_DATA = 1;
-    const int INSTRUCTION_LD = 2;
-    const int INSTRUCTION_LDA = 3;
-    const int INSTRUCTION_ST = 4;
-    const int INSTRUCTION_CONTROL = 5;
-    const int INSTRUCTION_PATT = 6;
-    const int INSTRUCTION_CALL = 7;
-
-    const int DATA_CONST = 0;
-    const int DATA_STRING = 1;
-    const int DATA_SEXP = 2;
-    const int DATA_STI = 3;
-    const int DATA_STA = 4;
-    const int DATA_JUMP = 5;
-    const int DATA_END = 6;
-    const int DATA_RET = 7;
-    const int DATA_DROP = 8;
-    const int DATA_DUP = 9;
-    const int DATA_SWAP = 10;
-    const int DATA_ELEM = 11;
-
-    const int CONTROL_CJMPZ = 0;
-    const int CONTROL_CJMPNZ = 1;
-    const int CONTROL_BEGIN = 2;
-    const int CONTROL_CBEGIN = 3;
-    const int CONTROL_CLOJURE = 4;
-    const int CONTROL_CALLC = 5;
-    const int CONTROL_CALL = 6;
-    const int CONTROL_TAG = 7;
-    const int CONTROL_ARRAY = 8;
-    const int CONTROL_FAIL = 9;
-    const int CONTROL_LINE = 10;
-
-    const int CALL_READ = 0;
-    const int CALL_WRITE = 1;
-    const int CALL_LENGTH = 2;
-    const int CALL_STRING = 3;
-    const int CALL_ARRAY = 4;
-
-    __init();  // init lama gc
-    context_t context;
-    size_t global_size = bf->global_area_size;
-    size_t* data_mem = malloc(STACK_SIZE * sizeof(size_t) * 2 + global_size * sizeof(size_t));
-    context.cstack.begin = data_mem;
-    context.cstack.n = STACK_SIZE;
-    context.cstack.sp = context.cstack.begin + context.cstack.n;
+// the arguments are popped only after the call, until then the GC updates them on the stack
+static inline void handle_call_extern(context_t* c) {
+    insn_t* i = next_insn(c);
+    int n = i->b.n;
+    sync_stack(c);
+    size_t res = call_builtin(i->c.ptr, get_stack_sp(c), n);
+    drop_stack_n(c, n);
+    push_stack(c, res);
+}
 
-    context.stack.p = data_mem + STACK_SIZE;
-    context.stack.n = STACK_SIZE;
+/* handlers of superinstructions: each one runs a fused sequence without
+   going through the operand stack between the steps */
 
-    context.globals.p = data_mem + STACK_SIZE * 2;
-    context.globals.n = global_size;
-    for (int i = 0; i < global_size; i++)
-        context.globals.p[i] = 0;
+// skip the records of the fused sequence and return the first one
+static inline insn_t* next_insns(context_t* c, size_t n) {
+    insn_t* i = c->ip;
+    c->ip += n;
+    ASSERT(c->ip < c->code.p + c->code.n, "Out of bounds bytecode");
+    return i;
+}
 
-    context.code.p = (uint8_t*)bf->code_ptr;
-    context.code.n = bf->code_size;
-    set_ip(&context, context.code.p);
+static inline size_t load_var(context_t* c, const insn_t* ld) {
+    return read_memory(c, ld->sub, ld->a.n);
+}
 
-    context.string_area.p = bf->string_ptr;
-    context.string_area.n = bf->stringtab_size;
-    context.is_closure = false;
+// LD x; LD y; BINOP op
+static inline void handle_super_ld_ld_binop(context_t* c) {
+    insn_t* i = next_insns(c, 3);
+    int32_t x = UNBOX((int32_t)load_var(c, &i[0]));
+    int32_t y = UNBOX((int32_t)load_var(c, &i[1]));
+    push_stack_boxed(c, do_binop(x, y, i[2].sub - 1));
+}
+
+// LD x; CONST n; BINOP op
+static inline void handle_super_ld_const_binop(context_t* c) {
+    insn_t* i = next_insns(c, 3);
+    int32_t x = UNBOX((int32_t)load_var(c, &i[0]));
+    int32_t y = UNBOX(BOX(i[1].a.n));  // the same truncation as a round trip through the stack
+    push_stack_boxed(c, do_binop(x, y, i[2].sub - 1));
+}
 
-    set_stack_sp(&context, context.stack.p + context.stack.n);
-    __gc_stack_bottom = (size_t)(data_mem + STACK_SIZE * 2 + global_size);
+// CONST n; BINOP op
+static inline void handle_super_const_binop(context_t* c) {
+    insn_t* i = next_insns(c, 2);
+    int32_t x = UNBOX((int32_t)pop_stack(c));
+    int32_t y = UNBOX(BOX(i[0].a.n));  // the same truncation as a round trip through the stack
+    push_stack_boxed(c, do_binop(x, y, i[1].sub - 1));
+}
 
-    push_stack_boxed(&context, 0);
-    push_stack_boxed(&context, 0);  // because main's BEGIN 2 0
-    context.bp = get_stack_sp();
+// BINOP op; CJMPZ l
+static inline void handle_super_binop_cjmpz(context_t* c) {
+    insn_t* i = next_insns(c, 2);
+    int32_t y = UNBOX((int32_t)pop_stack(c));
+    int32_t x = UNBOX((int32_t)pop_stack(c));
+    if (UNBOX(BOX(do_binop(x, y, i[0].sub - 1))) == 0)
+        set_ip(c, i[1].a.target);
+}
 
-    do {
-        uint8_t x = next_code_byte(&context), h = (x & 0xF0) >> 4, l = x & 0x0F;
+// LD x; CJMPZ l
+static inline void handle_super_ld_cjmpz(context_t* c) {
+    insn_t* i = next_insns(c, 2);
+    if (UNBOX(load_var(c, &i[0])) == 0)
+        set_ip(c, i[1].a.target);
+}
 
-        switch (h) {
-            case INSTRUCTION_EXIT:
-                return;
+// DUP; TAG t n; CJMPZ l
+static inline void handle_super_dup_tag_cjmpz(context_t* c) {
+    insn_t* i = next_insns(c, 3);
+    int res = Btag((void*)peek_stack(c), i[1].c.n, BOX(i[1].b.n));
+    if (UNBOX(res) == 0)
+        set_ip(c, i[2].a.target);
+}
 
-            case INSTRUCTION_BINOP:
-                handle_binop(&context, l);
-                break;
+// DUP; ARRAY n; CJMPZ l
+static inline void handle_super_dup_array_cjmpz(context_t* c) {
+    insn_t* i = next_insns(c, 3);
+    int res = Barray_patt((void*)peek_stack(c), BOX(i[1].a.n));
+    if (UNBOX(res) == 0)
+        set_ip(c, i[2].a.target);
+}
 
-            case INSTRUCTION_DATA:
-                switch (l) {
-                    case DATA_CONST:
-                        handle_const(&context);
-                        break;
-                    case DATA_STRING:
-                        handle_string(&context);
-                        break;
-                    case DATA_SEXP:
-                        handle_sexp(&context);
-                        break;
-                    case DATA_STI:
-                        handle_sti(&context);
-                        break;
-                    case DATA_STA:
-                        handle_sta(&context);
-                        break;
-                    case DATA_JUMP:
-                        handle_jump(&context);
-                        break;
-                    case DATA_END:
-                        if (handle_end(&context))
-                            return;
-                        break;
-                    case DATA_RET:
-                        handle_ret(&context);
-                        break;
-                    case DATA_DROP:
-                        handle_drop(&context);
-                        break;
-                    case DATA_DUP:
-                        handle_dup(&context);
-                        break;
-                    case DATA_SWAP:
-                        handle_swap(&context);
-                        break;
-                    case DATA_ELEM:
-                        handle_elem(&context);
-                        break;
-                    default:
-                        FAIL;
-                }
-                break;
+// ST x; DROP
+static inline void handle_super_st_drop(context_t* c) {
+    insn_t* i = next_insns(c, 2);
+    // the variable can be the slot of the new top, so it is written before the top is reloaded
+    size_t* var = get_memory(c, i[0].sub, i[0].a.n);
+    *var = c->tos;
+    if (i[0].sub == MEM_CLOSED)
+        gc_write_barrier((void**)var, (void*)c->tos);
+    drop_stack_n(c, 1);
+}
+
+// LD x; ELEM
+static inline void handle_super_ld_elem(context_t* c) {
+    insn_t* i = next_insns(c, 2);
+    size_t idx = load_var(c, &i[0]);
+    void* arr = (void*)pop_stack(c);
+    push_stack(c, (size_t)Belem(arr, idx));
+}
+
+// CONST n; ELEM
+static inline void handle_super_const_elem(context_t* c) {
+    insn_t* i = next_insns(c, 2);
+    void* arr = (void*)pop_stack(c);
+    push_stack(c, (size_t)Belem(arr, BOX(i[0].a.n)));
+}
+
+// STRING s; PATT =str: the string is only compared, so the literal is used without a copy
+static inline void handle_super_string_patt(context_t* c) {
+    insn_t* i = next_insns(c, 2);
+    c->tos = Bstring_patt(i[0].b.ptr, (void*)c->tos);
+}
+
+// STRING s; LENGTH
+static inline void handle_super_string_length(context_t* c) {
+    insn_t* i = next_insns(c, 2);
+    push_stack(c, Llength(i[0].b.ptr));
+}
+
+static inline uint32_t hash_case_key(int kind, int32_t tag, int32_t n) {
+    return ((uint32_t)tag * 0x9E3779B1u) ^ ((uint32_t)n * 0x85EBCA77u) ^ (uint32_t)kind;
+}
+
+// FNV-1a up to the terminating zero, the same part of the string that strcmp compares
+static inline int32_t hash_string(const char* s) {
+    uint32_t h = 2166136261u;
+    for (; *s != 0; s++)
+        h = (h ^ (uint8_t)*s) * 16777619u;
+    return (int32_t)h;
+}
 
-            case INSTRUCTION_LD:
-                handle_ld(&context, l);
+// the body of the first arm that matches x, or 0 if the arms have to be tested one by one
+static inline insn_t* find_case_arm(const case_table_t* t, size_t x) {
+    int kind = 0;
+    int32_t tag = 0, n = 0;
+    const char* str = 0;
+    if (!UNBOXED(x)) {
+        data* d = TO_DATA(x);
+        switch (TAG(d->data_header)) {
+            case SEXP_TAG:
+                kind = SEXP_TAG;
+                tag = TO_SEXP(x)->tag;
+                n = LEN(d->data_header);
                 break;
-            case INSTRUCTION_LDA:
-                handle_lda(&context, l);
+            case ARRAY_TAG:
+                kind = ARRAY_TAG;
+                n = LEN(d->data_header);
                 break;
-            case INSTRUCTION_ST:
-                handle_st(&context, l);
+            case STRING_TAG:
+                kind = STRING_TAG;
+                str = (const char*)x;
+                tag = hash_string(str);
                 break;
+        }
+    }
+    if (t->has_strings && kind != STRING_TAG)
+        return 0;
+    if (kind == 0)
+        return t->miss;
+    for (size_t k = hash_case_key(kind, tag, n) & t->mask;; k = (k + 1) & t->mask) {
+        const case_arm_t* a = &t->arms[k];
+        if (a->kind == 0)
+            return t->miss;
+        if (a->kind == kind && a->tag == tag && a->n == n && (str == 0 || strcmp(a->str, str) == 0))
+            return a->target;
+    }
+}
 
-            case INSTRUCTION_CONTROL:
-                switch (l) {
-                    case CONTROL_CJMPZ:
-                        handle_cjmpz(&context);
-                        break;
-                    case CONTROL_CJMPNZ:
-                        handle_cjmpnz(&context);
-                        break;
-                    case CONTROL_BEGIN:
-                        handle_begin(&context);
-                        break;
-                    case CONTROL_CBEGIN:
-                        handle_cbegin(&context);
-                        break;
-                    case CONTROL_CLOJURE:
-                        handle_clojure(&context);
-                        break;
-                    case CONTROL_CALLC:
-                        handle_callc(&context);
-                        break;
-                    case CONTROL_CALL:
-                        handle_call(&context);
-                        break;
-                    case CONTROL_TAG:
-                        handle_tag(&context);
-                        break;
-                    case CONTROL_ARRAY:
-                        handle_array(&context);
-                        break;
-                    case CONTROL_FAIL:
-                        handle_fail(&context);
-                        break;
-                    case CONTROL_LINE:
-                        handle_line(&context);
-                        break;
-                    default:
-                        FAIL;
-                }
-                break;
+// DUP at the head of a case chain, a is its table
+static inline void handle_super_case(context_t* c) {
+    insn_t* i = next_insn(c);
+    insn_t* target = find_case_arm(i->a.ptr, c->tos);
+    if (target == 0)
+        push_stack(c, c->tos);  // run DUP and the chain after it
+    else
+        set_ip(c, target);
+}
 
-            case INSTRUCTION_PATT:
-                handle_patt(&context, l);
-                break;
+/* handlers of the register tier: operands are frame slots given by their offsets from bp */
 
-            case INSTRUCTION_CALL:
-                switch (l) {
-                    case CALL_READ:
-                        handle_call_read(&context);
-                        break;
-                    case CALL_WRITE:
-                        handle_call_write(&context);
-                        break;
-                    case CALL_LENGTH:
-                        handle_call_length(&context);
-                        break;
-                    case CALL_STRING:
-                        handle_call_string(&context);
-                        break;
-                    case CALL_ARRAY:
-                        handle_call_array(&context);
-                        break;
-                    default:
-                        FAIL;
-                }
-                break;
+static inline size_t* get_frame_slot(context_t* c, int32_t offset) {
+    size_t* p = c->bp + offset;
+    ASSERT(c->stack.p <= p && p < c->stack.p + c->stack.n, "Out of bounds stack");
+    return p;
+}
+
+static inline void handle_reg_mov(context_t* c) {
+    insn_t* i = next_insn(c);
+    *get_frame_slot(c, i->a.n) = *get_frame_slot(c, i->b.n);
+}
+
+static inline void handle_reg_const(context_t* c) {
+    insn_t* i = next_insn(c);
+    *get_frame_slot(c, i->a.n) = (size_t)i->b.n;
+}
+
+static inline void handle_reg_load(context_t* c, MEM mem) {
+    insn_t* i = next_insn(c);
+    *get_frame_slot(c, i->a.n) = *get_memory(c, mem, i->b.n);
+}
+
+static inline void handle_reg_store(context_t* c, MEM mem) {
+    insn_t* i = next_insn(c);
+    size_t* var = get_memory(c, mem, i->a.n);
+    *var = *get_frame_slot(c, i->b.n);
+    if (mem == MEM_CLOSED)
+        gc_write_barrier((void**)var, (void*)*var);
+}
+
+static inline void handle_reg_binop(context_t* c) {
+    insn_t* i = next_insn(c);
+    int32_t x = UNBOX((int32_t)*get_frame_slot(c, i->b.n));
+    int32_t y = UNBOX((int32_t)*get_frame_slot(c, i->c.n));
+    *get_frame_slot(c, i->a.n) = BOX(do_binop(x, y, i->sub - 1));
+}
+
+// the second operand is an unboxed constant
+static inline void handle_reg_binop_imm(context_t* c) {
+    insn_t* i = next_insn(c);
+    int32_t x = UNBOX((int32_t)*get_frame_slot(c, i->b.n));
+    *get_frame_slot(c, i->a.n) = BOX(do_binop(x, i->c.n, i->sub - 1));
+}
+
+static inline void handle_reg_jump(context_t* c) { set_ip(c, next_insn(c)->a.target); }
+
+static inline void handle_reg_jz(context_t* c) {
+    insn_t* i = next_insn(c);
+    if (UNBOX(*get_frame_slot(c, i->a.n)) == 0)
+        set_ip(c, i->b.target);
+}
+
+static inline void handle_reg_jnz(context_t* c) {
+    insn_t* i = next_insn(c);
+    if (UNBOX(*get_frame_slot(c, i->a.n)) != 0)
+        set_ip(c, i->b.target);
+}
+
+// instructions without a register form run with sp and the cached top set for the static depth
+static inline void handle_reg_enter(context_t* c) {
+    c->sp = get_frame_slot(c, next_insn(c)->a.n);
+    reload_stack_top(c);
+}
+
+static inline void handle_reg_leave(context_t* c) {
+    ASSERT(c->sp == c->bp + next_insn(c)->a.n, "Unexpected stack depth in the register tier");
+    flush_stack_top(c);
+}
+
+// calls switch to stack mode by themselves, b is the top of the stack
+static inline void handle_reg_call(context_t* c) {
+    c->sp = get_frame_slot(c, c->ip->b.n);
+    reload_stack_top(c);
+    handle_call(c);
+}
+
+// END or RET, a is the returned value and b the top of the stack
+static inline bool handle_reg_end(context_t* c) {
+    c->tos = *get_frame_slot(c, c->ip->a.n);
+    c->sp = get_frame_slot(c, c->ip->b.n);
+    return handle_end(c);
+}
+
+// BEGIN of a translated function: the frame is built as usual, the body runs in the register tier
+static inline void handle_reg_begin(context_t* c) {
+    insn_t* entry = c->ip->c.target;
+    handle_begin(c);
+    flush_stack_top(c);
+    set_ip(c, entry);
+}
+
+/* Superinstructions: fused sequences get numbers after all bytecode opcodes */
+enum {
+    SUPER_LD_LD_BINOP = 0x100,
+    SUPER_LD_CONST_BINOP,
+    SUPER_CONST_BINOP,
+    SUPER_BINOP_CJMPZ,
+    SUPER_LD_CJMPZ,
+    SUPER_DUP_TAG_CJMPZ,
+    SUPER_DUP_ARRAY_CJMPZ,
+    SUPER_ST_DROP,
+    SUPER_LD_ELEM,
+    SUPER_CONST_ELEM,
+    SUPER_STRING_PATT,
+    SUPER_STRING_LENGTH,
+    SUPER_TAIL_CALL,
+    SUPER_TAIL_CALLC,
+    SUPER_CASE, /* not a fused sequence: DUP at the head of a case chain, see compile_case_chains */
+};
+
+/* Instructions of the register tier, see translate_function */
+enum {
+    REG_MOV = SUPER_CASE + 1,
+    REG_CONST,
+    REG_LOAD_GLOBAL,
+    REG_LOAD_CLOSED,
+    REG_STORE_GLOBAL,
+    REG_STORE_CLOSED,
+    REG_BINOP,
+    REG_BINOP_IMM,
+    REG_JUMP,
+    REG_JZ,
+    REG_JNZ,
+    REG_ENTER,
+    REG_LEAVE,
+    REG_CALL,
+    REG_END,
+    JIT_RESUME, /* enters compiled code after an instruction it left to the interpreter */
+    OPCODES_NUMBER,
+};
+
+/* Pre-decoding of the bytecode */
+
+typedef struct {
+    const bytefile* bf;
+    const uint8_t* p;
+    const uint8_t* end;
+} code_reader_t;
+
+static inline uint8_t read_code_byte(code_reader_t* r) {
+    if (r->p + 1 > r->end)
+        failure("Truncated bytecode\n");
+    return *r->p++;
+}
+
+static inline int read_code_int(code_reader_t* r) {
+    if (r->p + sizeof(int) > r->end)
+        failure("Truncated bytecode\n");
+    int v = *(int*)r->p;
+    r->p += sizeof(int);
+    return v;
+}
+
+static inline char* read_code_string(code_reader_t* r) {
+    int idx = read_code_int(r);
+    if (idx < 0 || idx >= r->bf->stringtab_size ||
+        memchr(&r->bf->string_ptr[idx], 0, r->bf->stringtab_size - idx) == 0)
+        failure("Invalid string offset 0x%.8x\n", idx);
+    return &r->bf->string_ptr[idx];
+}
+
+// decodes one instruction; offsets of jump targets are left in operands and resolved later
+static void decode_insn(code_reader_t* r, insn_t* i, capture_t* captures, size_t* captures_n) {
+#define FAIL failure("ERROR: invalid opcode %d-%d\n", h, l)
+    uint8_t x = read_code_byte(r), h = (x & 0xF0) >> 4, l = x & 0x0F;
+    *i = (insn_t){.op = x, .sub = l};
+    switch (h) {
+        case INSTRUCTION_EXIT:
+            break;
+
+        case INSTRUCTION_BINOP:
+            if (l < 1 || l > 13)
+                FAIL;
+            break;
+
+        case INSTRUCTION_DATA:
+            switch (l) {
+                case DATA_CONST:
+                case DATA_JUMP:
+                    i->a.n = read_code_int(r);
+                    break;
+                case DATA_STRING:
+                    i->a.str = read_code_string(r);
+                    break;
+                case DATA_SEXP:
+                    i->a.str = read_code_string(r);
+                    i->b.n = read_code_int(r);
+                    i->c.n = LtagHash(i->a.str);
+                    break;
+                case DATA_STI:
+                case DATA_STA:
+                case DATA_END:
+                case DATA_RET:
+                case DATA_DROP:
+                case DATA_DUP:
+                case DATA_SWAP:
+                case DATA_ELEM:
+                    break;
+                default:
+                    FAIL;
+            }
+            break;
+
+        case INSTRUCTION_LD:
+        case INSTRUCTION_LDA:
+        case INSTRUCTION_ST:
+            if (l > MEM_CLOSED)
+                FAIL;
+            i->a.n = read_code_int(r);
+            break;
+
+        case INSTRUCTION_CONTROL:
+            switch (l) {
+                case CONTROL_CJMPZ:
+                case CONTROL_CJMPNZ:
+                case CONTROL_CALLC:
+                case CONTROL_ARRAY:
+                case CONTROL_LINE:
+                    i->a.n = read_code_int(r);
+                    break;
+                case CONTROL_BEGIN:
+                case CONTROL_CBEGIN:
+                case CONTROL_CALL:
+                case CONTROL_FAIL:
+                    i->a.n = read_code_int(r);
+                    i->b.n = read_code_int(r);
+                    break;
+                case CONTROL_TAG:
+                    i->a.str = read_code_string(r);
+                    i->b.n = read_code_int(r);
+                    i->c.n = LtagHash(i->a.str);
+                    break;
+                case CONTROL_CLOJURE:
+                    i->a.n = read_code_int(r);
+                    i->b.n = read_code_int(r);
+                    i->c.n = *captures_n;  // index of the first capture, resolved later
+                    for (int k = 0; k < i->b.n; k++) {
+                        capture_t* cap = &captures[(*captures_n)++];
+                        cap->mem = (MEM)read_code_byte(r);
+                        cap->idx = read_code_int(r);
+                    }
+                    break;
+                default:
+                    FAIL;
+            }
+            break;
+
+        case INSTRUCTION_PATT:
+            if (l > 6)
+                FAIL;
+            break;
 
-            default:
+        case INSTRUCTION_CALL:
+            if (l > CALL_EXTERN)
                 FAIL;
+            if (l == CALL_ARRAY)
+                i->a.n = read_code_int(r);
+            if (l == CALL_EXTERN) {
+                i->a.str = read_code_string(r);
+                i->b.n = read_code_int(r);
+                i->c.ptr = (void*)find_builtin(i->a.str);
+                if (i->c.ptr == 0)
+                    failure("Unknown external function %s\n", i->a.str);
+            }
+            break;
+
+        default:
+            FAIL;
+    }
+#undef FAIL
+}
+
+// entries stay sorted by insn, a later LINE before the same record wins
+static void add_line(program_t* p, size_t insn, int32_t line) {
+    if (p->lines_n > 0 && p->lines[p->lines_n - 1].insn == insn)
+        p->lines_n--;
+    if (p->lines_n > 0 && p->lines[p->lines_n - 1].line == line)
+        return;
+    p->lines[p->lines_n++] = (line_entry_t){.insn = insn, .line = line};
+}
+
+// the source line of a record of the program stream, 0 if it is unknown
+static int32_t get_line(const program_t* p, const insn_t* i) {
+    if (i < p->code.p || i >= p->code.p + p->code.n)
+        return 0;  // generated at run time
+    uint32_t k = i - p->code.p;
+    size_t lo = 0, hi = p->lines_n;  // the first entry past k
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (p->lines[mid].insn <= k)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo == 0 ? 0 : p->lines[lo - 1].line;
+}
+
+static insn_t* resolve_offset(program_t* p, int offset) {
+    if (offset < 0 || offset >= p->code_size || p->insn_of_offset[offset] < 0)
+        failure("Invalid jump target 0x%.8x\n", offset);
+    return &p->code.p[p->insn_of_offset[offset]];
+}
+
+/* Superinstruction patterns; an opcode matches an element if (op & mask) == value.
+   The set follows the most frequent pairs and triples reported by a build with
+   -DPROFILE_SEQUENCES; longer patterns go first. */
+#define ANY_LD {0xF0, OPCODE(INSTRUCTION_LD, 0)}
+#define ANY_ST {0xF0, OPCODE(INSTRUCTION_ST, 0)}
+#define ANY_BINOP {0xF0, OPCODE(INSTRUCTION_BINOP, 0)}
+#define ONLY(h, l) {0xFF, OPCODE(h, l)}
+#define END_OR_RET {0xFE, OPCODE(INSTRUCTION_DATA, DATA_END)}
+
+static const struct {
+    uint16_t op;
+    uint8_t len;
+    struct {
+        uint8_t mask, value;
+    } elems[3];
+} superinstructions[] = {
+    {SUPER_LD_LD_BINOP, 3, {ANY_LD, ANY_LD, ANY_BINOP}},
+    {SUPER_LD_CONST_BINOP, 3, {ANY_LD, ONLY(INSTRUCTION_DATA, DATA_CONST), ANY_BINOP}},
+    {SUPER_DUP_TAG_CJMPZ,
+     3,
+     {ONLY(INSTRUCTION_DATA, DATA_DUP),
+      ONLY(INSTRUCTION_CONTROL, CONTROL_TAG),
+      ONLY(INSTRUCTION_CONTROL, CONTROL_CJMPZ)}},
+    {SUPER_DUP_ARRAY_CJMPZ,
+     3,
+     {ONLY(INSTRUCTION_DATA, DATA_DUP),
+      ONLY(INSTRUCTION_CONTROL, CONTROL_ARRAY),
+      ONLY(INSTRUCTION_CONTROL, CONTROL_CJMPZ)}},
+    {SUPER_CONST_BINOP, 2, {ONLY(INSTRUCTION_DATA, DATA_CONST), ANY_BINOP}},
+    {SUPER_BINOP_CJMPZ, 2, {ANY_BINOP, ONLY(INSTRUCTION_CONTROL, CONTROL_CJMPZ)}},
+    {SUPER_LD_CJMPZ, 2, {ANY_LD, ONLY(INSTRUCTION_CONTROL, CONTROL_CJMPZ)}},
+    {SUPER_ST_DROP, 2, {ANY_ST, ONLY(INSTRUCTION_DATA, DATA_DROP)}},
+    {SUPER_LD_ELEM, 2, {ANY_LD, ONLY(INSTRUCTION_DATA, DATA_ELEM)}},
+    {SUPER_CONST_ELEM, 2, {ONLY(INSTRUCTION_DATA, DATA_CONST), ONLY(INSTRUCTION_DATA, DATA_ELEM)}},
+    // not among the most frequent ones: they let a string literal skip the copy made by STRING
+    {SUPER_STRING_PATT, 2, {ONLY(INSTRUCTION_DATA, DATA_STRING), ONLY(INSTRUCTION_PATT, 0)}},
+    {SUPER_STRING_LENGTH,
+     2,
+     {ONLY(INSTRUCTION_DATA, DATA_STRING), ONLY(INSTRUCTION_CALL, CALL_LENGTH)}},
+    // calls in tail position, END_OR_RET matches both
+    {SUPER_TAIL_CALL, 2, {ONLY(INSTRUCTION_CONTROL, CONTROL_CALL), END_OR_RET}},
+    {SUPER_TAIL_CALLC, 2, {ONLY(INSTRUCTION_CONTROL, CONTROL_CALLC), END_OR_RET}},
+};
+
+#undef ANY_LD
+#undef ANY_ST
+#undef ANY_BINOP
+#undef ONLY
+#undef END_OR_RET
+
+static bool match_superinstruction(const insn_t* i, const insn_t* end, size_t k) {
+    if (end - i < superinstructions[k].len)
+        return false;
+    for (size_t j = 0; j < superinstructions[k].len; j++) {
+        uint8_t mask = superinstructions[k].elems[j].mask;
+        if (i[j].op > 0xFF || (i[j].op & mask) != superinstructions[k].elems[j].value)
+            return false;
+    }
+    return true;
+}
+
+/* Replaces the first record of every matched sequence by its superinstruction.
+   The rest of the records stay in place, so jumps into the middle of a sequence
+   still run it instruction by instruction. */
+static void fuse_superinstructions(program_t* p) {
+    const insn_t* end = p->code.p + p->code.n;
+    for (insn_t* i = p->code.p; i < end;) {
+        size_t len = 1;
+        for (size_t k = 0; k < sizeof(superinstructions) / sizeof(superinstructions[0]); k++) {
+            if (match_superinstruction(i, end, k)) {
+                i->op = superinstructions[k].op;
+                len = superinstructions[k].len;
+                break;
+            }
         }
+        i += len;
+    }
+}
 
-    } while (1);
+// the opcode a record had before fusion: the first element of a pattern is either
+// a single opcode or a group with the low nibble kept in sub
+static uint16_t get_base_opcode(const insn_t* i) {
+    if (i->op <= 0xFF)
+        return i->op;
+    if (i->op == SUPER_CASE)
+        return OPCODE(INSTRUCTION_DATA, DATA_DUP);
+    for (size_t k = 0; k < sizeof(superinstructions) / sizeof(superinstructions[0]); k++) {
+        if (superinstructions[k].op == i->op) {
+            uint8_t mask = superinstructions[k].elems[0].mask;
+            return superinstructions[k].elems[0].value | (i->sub & (uint8_t)~mask);
+        }
+    }
+    failure("Unknown superinstruction %d\n", i->op);
+    return 0;
 }
 
-/* Reads a binary bytecode file by name and unpacks it */
-bytefile* read_file(char* fname) {
-    FILE* f = fopen(fname, "rb");
-    long size;
-    bytefile* file;
+/*
+Case chains.
+
+A case is compiled to a chain of arms, each of them DUP; test; CJMPZ next with one of
+the tests TAG t n, ARRAY n or STRING s; PATT =str. The DUP of the first arm becomes
+SUPER_CASE: it looks the top up in a hash table of all arms of the chain and jumps
+to the body of the first one that matches, or to the code after the chain. The
+records of the arms stay in place for jumps from failed nested patterns. A string
+pattern fails on a value that is not a string, so chains with strings are run arm
+by arm for such values.
+*/
+
+#define CASE_CHAIN_MIN_ARMS 3
+
+// decodes the arm at i into a, returns the CJMPZ of the arm or 0 if there is no arm at i
+static const insn_t* match_case_arm(const insn_t* i, const insn_t* end, case_arm_t* a) {
+    if (end - i < 4 || i[0].op != OPCODE(INSTRUCTION_DATA, DATA_DUP))
+        return 0;
+    *a = (case_arm_t){0};
+    const insn_t* cjmpz;
+    if (i[1].op == OPCODE(INSTRUCTION_CONTROL, CONTROL_TAG)) {
+        *a = (case_arm_t){.kind = SEXP_TAG, .tag = UNBOX(i[1].c.n), .n = i[1].b.n};
+        cjmpz = &i[2];
+    } else if (i[1].op == OPCODE(INSTRUCTION_CONTROL, CONTROL_ARRAY)) {
+        *a = (case_arm_t){.kind = ARRAY_TAG, .n = i[1].a.n};
+        cjmpz = &i[2];
+    } else if (i[1].op == OPCODE(INSTRUCTION_DATA, DATA_STRING) &&
+               i[2].op == OPCODE(INSTRUCTION_PATT, 0)) {
+        *a = (case_arm_t){.kind = STRING_TAG, .tag = hash_string(i[1].a.str), .str = i[1].a.str};
+        cjmpz = &i[3];
+    } else {
+        return 0;
+    }
+    if (cjmpz->op != OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPZ) || cjmpz->a.target <= cjmpz)
+        return 0;
+    a->target = (insn_t*)cjmpz + 1;
+    return cjmpz;
+}
 
-    if (f == 0) {
-        failure("%s\n", strerror(errno));
+static void add_case_arm(case_table_t* t, const case_arm_t* a) {
+    size_t k = hash_case_key(a->kind, a->tag, a->n) & t->mask;
+    for (; t->arms[k].kind != 0; k = (k + 1) & t->mask) {
+        const case_arm_t* b = &t->arms[k];
+        if (b->kind == a->kind && b->tag == a->tag && b->n == a->n &&
+            (a->str == 0 || strcmp(a->str, b->str) == 0))
+            return;  // an earlier arm with the same pattern always wins
     }
+    t->arms[k] = *a;
+}
 
-    if (fseek(f, 0, SEEK_END) == -1) {
-        failure("%s\n", strerror(errno));
+// compiles the chain starting at head, the arms after the first one are marked in is_arm
+static void compile_case_chain(program_t* p, insn_t* head, bool* is_arm) {
+    const insn_t* end = p->code.p + p->code.n;
+    case_arm_t a;
+    size_t arms_n = 0;
+    const insn_t* i = head;
+    for (const insn_t* cjmpz; (cjmpz = match_case_arm(i, end, &a)) != 0; i = cjmpz->a.target)
+        arms_n++;
+    if (arms_n < CASE_CHAIN_MIN_ARMS)
+        return;
+
+    size_t slots_n = 1;
+    while (slots_n < 2 * arms_n)
+        slots_n *= 2;
+    case_table_t* t = calloc(1, sizeof(case_table_t) + slots_n * sizeof(case_arm_t));
+    if (t == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    t->mask = slots_n - 1;
+    i = head;
+    for (const insn_t* cjmpz; (cjmpz = match_case_arm(i, end, &a)) != 0; i = cjmpz->a.target) {
+        if (i != head)
+            is_arm[i - p->code.p] = true;
+        t->has_strings |= a.kind == STRING_TAG;
+        add_case_arm(t, &a);
     }
+    t->miss = (insn_t*)i;
+    t->next = p->case_tables;
+    p->case_tables = t;
 
-    file = (bytefile*)malloc(sizeof(bytefile) + (size = ftell(f)));
+    head->op = SUPER_CASE;
+    head->a.ptr = t;
+}
 
-    if (file == 0) {
+static void compile_case_chains(program_t* p) {
+    bool* is_arm = calloc(p->code.n, sizeof(bool));
+    if (is_arm == 0)
         failure("*** FAILURE: unable to allocate memory.\n");
+    for (insn_t* i = p->code.p; i < p->code.p + p->code.n; i++) {
+        if (!is_arm[i - p->code.p])
+            compile_case_chain(p, i, is_arm);
     }
+    free(is_arm);
+}
 
-    rewind(f);
+// the number of values an instruction pops and pushes, false if it is not known statically
+static bool get_stack_effect(const insn_t* i, uint16_t op, int* pops, int* pushes) {
+    uint8_t h = op >> 4, l = op & 0x0F;
+    *pops = 0;
+    *pushes = 1;
+    switch (h) {
+        case INSTRUCTION_BINOP:
+            *pops = 2;
+            return true;
+        case INSTRUCTION_DATA:
+            switch (l) {
+                case DATA_CONST:
+                case DATA_STRING:
+                    return true;
+                case DATA_SEXP:
+                    *pops = i->b.n;
+                    return true;
+                case DATA_STI:
+                    *pops = 2;
+                    *pushes = 0;
+                    return true;
+                case DATA_ELEM:
+                    *pops = 2;
+                    return true;
+                case DATA_STA:
+                    // an array and an index, the tiers do not support references made by LDA
+                    *pops = 3;
+                    return true;
+                case DATA_JUMP:
+                    *pushes = 0;
+                    return true;
+                case DATA_END:
+                case DATA_RET:
+                case DATA_DROP:
+                    *pops = 1;
+                    *pushes = 0;
+                    return true;
+                case DATA_DUP:
+                    *pops = 1;
+                    *pushes = 2;
+                    return true;
+                case DATA_SWAP:
+                    *pops = 2;
+                    *pushes = 2;
+                    return true;
+            }
+            return false;
+        case INSTRUCTION_LD:
+            return true;
+        case INSTRUCTION_ST:
+            *pops = 1;
+            return true;
+        case INSTRUCTION_CONTROL:
+            switch (l) {
+                case CONTROL_CJMPZ:
+                case CONTROL_CJMPNZ:
+                    *pops = 1;
+                    *pushes = 0;
+                    return true;
+                case CONTROL_CLOJURE:
+                    return true;
+                case CONTROL_CALLC:
+                    *pops = i->a.n + 1;
+                    return true;
+                case CONTROL_CALL:
+                    *pops = i->b.n;
+                    return true;
+                case CONTROL_TAG:
+                case CONTROL_ARRAY:
+                    *pops = 1;
+                    return true;
+                case CONTROL_FAIL:
+                    *pushes = 0;
+                    return true;
+            }
+            return false;
+        case INSTRUCTION_PATT:
+            *pops = l == 0 ? 2 : 1;
+            return true;
+        case INSTRUCTION_CALL:
+            if (l == CALL_ARRAY)
+                *pops = i->a.n;
+            else if (l == CALL_EXTERN)
+                *pops = i->b.n;
+            else if (l != CALL_READ)
+                *pops = 1;
+            return true;
+    }
+    return false;
+}
 
-    if (size != fread(&file->stringtab_size, 1, size, f)) {
-        failure("%s\n", strerror(errno));
+static bool is_terminal(uint16_t op) {
+    switch (op) {
+        case OPCODE(INSTRUCTION_DATA, DATA_JUMP):
+        case OPCODE(INSTRUCTION_DATA, DATA_END):
+        case OPCODE(INSTRUCTION_DATA, DATA_RET):
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_FAIL):
+            return true;
     }
+    return false;
+}
+
+static bool is_branch(uint16_t op) {
+    return op == OPCODE(INSTRUCTION_DATA, DATA_JUMP) ||
+           op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPZ) ||
+           op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPNZ);
+}
 
-    fclose(f);
+/*
+Load-time verification. Every function, from its BEGIN to the next one, is walked
+along its control flow with the stack depth before every record: paths that merge
+have to agree on it and no instruction may pop more than there is. Variables have
+to be inside the frame of the function, jumps inside the function, and CALL has to
+pass as many arguments as its callee takes. References made by LDA live on the stack
+too: they are tracked by their depth and can only be stored through or dropped.
+
+A closure has as many cells as its CLOSURE captures, so the closed variables of a
+function are checked against all CLOSUREs of it, and a function that uses them must
+not be entered by CALL, which passes no closure. The arguments of CALLC are checked
+when the call site misses its cache, see get_callee.
+
+Verified code runs with no checks at all. Overflows of the stacks hit their guard
+regions, which are at least as large as the largest frame of the program, its locals
+and its deepest operand stack, see reserve_stack.
+*/
+typedef struct stack_ref {
+    int32_t at;             /* the depth of its slot                   */
+    struct stack_ref* next; /* the reference below it                  */
+    struct stack_ref* all;  /* every reference made, to free them      */
+} stack_ref_t;
 
-    file->string_ptr = &file->buffer[file->public_symbols_number * 2 * sizeof(int)];
-    file->public_ptr = (int*)file->buffer;
-    file->code_ptr = &file->string_ptr[file->stringtab_size];
-    file->code_size = size - (file->public_symbols_number * 2 * sizeof(int)) - file->stringtab_size;
+typedef struct {
+    program_t* p;
+    size_t begin, end;   /* the records of the function being verified          */
+    int32_t max_depth;   /* of the operand stack of the function                */
+    int32_t* depth;      /* the stack depth before every record, -1 if not reached */
+    stack_ref_t** refs;  /* the references on the stack before every record     */
+    size_t* worklist;
+    size_t w;
+    stack_ref_t* all;
+    int32_t* closed_n;   /* by BEGIN: the number of closed variables it uses       */
+    int32_t* cells_n;    /* by BEGIN: the fewest cells of its closures, -1 if none */
+    bool* is_called;     /* by BEGIN: entered by CALL                              */
+} verifier_t;
+
+static void reject(const verifier_t* v, size_t k, const char* what) {
+    size_t offset = 0;  // LINEs before the record resolve to it too, its own offset is the last
+    for (size_t o = 0; o < v->p->code_size; o++) {
+        if (v->p->insn_of_offset[o] == (int32_t)k)
+            offset = o;
+    }
+    failure("Invalid bytecode at 0x%.8x: %s\n", (int)offset, what);
+}
 
-    return file;
+static bool same_refs(const stack_ref_t* a, const stack_ref_t* b) {
+    for (; a != 0 && b != 0 && a != b; a = a->next, b = b->next) {
+        if (a->at != b->at)
+            return false;
+    }
+    return a == b;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
+static void reach(verifier_t* v, size_t from, size_t k, int32_t d, stack_ref_t* refs) {
+    if (k <= v->begin || k >= v->end)
+        reject(v, from, "control leaves the function");
+    if (v->depth[k] < 0) {
+        v->depth[k] = d;
+        v->refs[k] = refs;
+        v->worklist[v->w++] = k;
+    } else if (v->depth[k] != d || !same_refs(v->refs[k], refs)) {
+        reject(v, from, "stack depths disagree where paths merge");
+    }
+}
+
+static void check_var(verifier_t* v, size_t k, MEM mem, int32_t idx) {
+    const insn_t* begin = &v->p->code.p[v->begin];
+    int32_t n;
+    switch (mem) {
+        case MEM_GLOBAL:
+            n = v->p->global_area_size;
+            break;
+        case MEM_LOCAL:
+            n = begin->b.n;
+            break;
+        case MEM_ARG:
+            n = begin->a.n;
+            break;
+        case MEM_CLOSED:
+            n = INT32_MAX;
+            if (idx >= v->closed_n[v->begin])
+                v->closed_n[v->begin] = idx + 1;
+            break;
+        default:
+            reject(v, k, "invalid kind of variable");
+            return;
+    }
+    if (idx < 0 || idx >= n)
+        reject(v, k, "variable out of the frame");
+}
+
+// the callee of CALL and CLOSURE, recording how it is entered
+static void check_callee(verifier_t* v, size_t k, const insn_t* callee) {
+    const insn_t* i = &v->p->code.p[k];
+    if (!is_function_begin(callee->op))
+        reject(v, k, "the callee is not a function");
+    size_t f = callee - v->p->code.p;
+    if (i->op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL)) {
+        if (i->b.n != callee->a.n)
+            reject(v, k, "wrong number of arguments");
+        v->is_called[f] = true;
+    } else if (v->cells_n[f] < 0 || i->b.n < v->cells_n[f]) {
+        v->cells_n[f] = i->b.n;
+    }
+}
+
+static void verify_insn(verifier_t* v, size_t k) {
+    insn_t* i = &v->p->code.p[k];
+    uint8_t h = i->op >> 4, l = i->op & 0x0F;
+    int32_t d = v->depth[k];
+    stack_ref_t* refs = v->refs[k];
+    int pops, pushes, held = 0;  // held: values pushed and popped by the instruction itself
+    if (h == INSTRUCTION_LD || h == INSTRUCTION_LDA || h == INSTRUCTION_ST)
+        check_var(v, k, (MEM)l, i->a.n);
+    if (h == INSTRUCTION_LDA) {
+        pops = 0;
+        pushes = 1;
+    } else if (i->op == OPCODE(INSTRUCTION_DATA, DATA_STA)) {
+        pops = refs != 0 && refs->at == d - 2 ? 2 : 3;  // a reference and a value, or an array
+        pushes = 1;
+    } else if (!get_stack_effect(i, i->op, &pops, &pushes)) {
+        reject(v, k, "unexpected instruction");
+    }
+    if (pops < 0)
+        reject(v, k, "negative number of values");
+    if (d < pops)
+        reject(v, k, "stack underflow");
+
+    switch (i->op) {
+        case OPCODE(INSTRUCTION_DATA, DATA_STI):
+            if (refs == 0 || refs->at != d - 2)
+                reject(v, k, "STI without a reference");
+            refs = refs->next;
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_STA):
+            if (pops == 2)
+                refs = refs->next;
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_DROP):
+            if (refs != 0 && refs->at == d - 1)
+                refs = refs->next;
+            break;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CALLC):
+            if (i->a.n < 0)
+                reject(v, k, "negative number of values");
+            break;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL):
+            check_callee(v, k, i->a.target);
+            break;
+        case OPCODE(INSTRUCTION_CALL, CALL_EXTERN): {
+            const builtin_t* f = i->c.ptr;
+            if (i->b.n < f->args_n || (i->b.n > f->args_n && !(f->flags & BUILTIN_VARIADIC)) ||
+                i->b.n > BUILTIN_MAX_ARGS)
+                reject(v, k, "wrong number of arguments of an external function");
+            break;
+        }
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CLOJURE):
+            if (i->b.n < 0)
+                reject(v, k, "negative number of values");
+            check_callee(v, k, resolve_offset(v->p, i->a.n));
+            for (const capture_t* cap = i->c.ptr; cap < (capture_t*)i->c.ptr + i->b.n; cap++)
+                check_var(v, k, cap->mem, cap->idx);
+            held = i->b.n;
+            break;
+    }
+    if (refs != 0 && refs->at >= d - pops)
+        reject(v, k, "a reference is used as a value");
+
+    int32_t next = d - pops + pushes;
+    if (h == INSTRUCTION_LDA) {
+        stack_ref_t* r = malloc(sizeof(stack_ref_t));
+        if (r == 0)
+            failure("*** FAILURE: unable to allocate memory.\n");
+        *r = (stack_ref_t){.at = d, .next = refs, .all = v->all};
+        v->all = refs = r;
+    }
+    if (d + held > v->max_depth)
+        v->max_depth = d + held;
+    if (next > v->max_depth)
+        v->max_depth = next;
+
+    if (is_branch(i->op))
+        reach(v, k, i->a.target - v->p->code.p, next, refs);
+    if (!is_terminal(i->op))
+        reach(v, k, k + 1, next, refs);
+}
+
+static void verify_function(verifier_t* v) {
+    const insn_t* begin = &v->p->code.p[v->begin];
+    if (begin->a.n < 0 || begin->b.n < 0)
+        reject(v, v->begin, "negative size of the frame");
+    v->max_depth = 0;
+    v->w = 0;
+    reach(v, v->begin, v->begin + 1, 0, 0);
+    while (v->w > 0)
+        verify_insn(v, v->worklist[--v->w]);
+    if ((size_t)begin->b.n + v->max_depth > v->p->max_frame)
+        v->p->max_frame = (size_t)begin->b.n + v->max_depth;
+}
+
+// rejects the program with failure() unless it passes, and finds its largest frame
+static void verify_program(program_t* p) {
+    size_t n = p->code.n;
+    verifier_t v = {
+        .p = p,
+        .depth = malloc(n * sizeof(int32_t)),
+        .refs = malloc(n * sizeof(stack_ref_t*)),
+        .worklist = malloc(n * sizeof(size_t)),
+        .closed_n = calloc(n, sizeof(int32_t)),
+        .cells_n = malloc(n * sizeof(int32_t)),
+        .is_called = calloc(n, sizeof(bool)),
+    };
+    if (v.depth == 0 || v.refs == 0 || v.worklist == 0 || v.closed_n == 0 || v.cells_n == 0 ||
+        v.is_called == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    for (size_t k = 0; k < n; k++) {
+        v.depth[k] = -1;
+        v.cells_n[k] = -1;
+    }
+
+    // main is entered with two arguments and no closure, see interpret
+    if (p->code.p[0].op != OPCODE(INSTRUCTION_CONTROL, CONTROL_BEGIN) || p->code.p[0].a.n != 2)
+        reject(&v, 0, "the program does not start with BEGIN 2");
+    v.is_called[0] = true;
+    p->max_frame = 0;
+    for (v.begin = 0; v.begin < n; v.begin = v.end) {
+        v.end = v.begin + 1;
+        if (!is_function_begin(p->code.p[v.begin].op))
+            continue;  // not reachable: jumps stay in functions and calls go to BEGINs
+        while (v.end < n && !is_function_begin(p->code.p[v.end].op) &&
+               (p->code.p[v.end].op >> 4) != INSTRUCTION_EXIT)
+            v.end++;
+        verify_function(&v);
+    }
+    for (size_t f = 0; f < n; f++) {
+        if (v.closed_n[f] > 0 && v.is_called[f])
+            reject(&v, f, "closed variables in a function entered without a closure");
+        if (v.closed_n[f] > 0 && 0 <= v.cells_n[f] && v.cells_n[f] < v.closed_n[f])
+            reject(&v, f, "closed variables out of the closure");
+    }
+
+    while (v.all != 0) {
+        stack_ref_t* r = v.all;
+        v.all = r->all;
+        free(r);
+    }
+    free(v.depth);
+    free(v.refs);
+    free(v.worklist);
+    free(v.closed_n);
+    free(v.cells_n);
+    free(v.is_called);
+}
+
+/* Translates the bytecode pool into the pre-decoded instruction stream */
+program_t* load_program(bytefile* bf) {
+    program_t* p = malloc(sizeof(program_t));
+    if (p == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    p->code_size = bf->code_size;
+    p->global_area_size = bf->global_area_size;
+    p->code_blocks = 0;
+    p->case_tables = 0;
+    p->jit = 0;
+    p->image = 0;
+
+    // every instruction takes at least one byte, every capture and every STRING at least five
+    p->insn_of_offset = malloc((p->code_size + 1) * sizeof(int32_t));
+    insn_t* code = malloc((p->code_size + 1) * sizeof(insn_t));
+    p->captures = malloc((p->code_size / 5 + 1) * sizeof(capture_t));
+    p->literals = malloc((p->code_size / 5 + 1) * sizeof(void*));
+    p->literals_n = 0;
+    p->lines = malloc((p->code_size / 5 + 1) * sizeof(line_entry_t));
+    p->lines_n = 0;
+    if (p->insn_of_offset == 0 || code == 0 || p->captures == 0 || p->literals == 0 ||
+        p->lines == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    for (size_t i = 0; i < p->code_size; i++)
+        p->insn_of_offset[i] = -1;
+
+    const uint8_t* begin = (uint8_t*)bf->code_ptr;
+    code_reader_t r = {.bf = bf, .p = begin, .end = begin + bf->code_size};
+    size_t n = 0, captures_n = 0;
+    while (r.p < r.end) {
+        p->insn_of_offset[r.p - begin] = n;
+        decode_insn(&r, &code[n], p->captures, &captures_n);
+        // LINE goes to the side table: its offset resolves to the record after it
+        if (code[n].op == OPCODE(INSTRUCTION_CONTROL, CONTROL_LINE))
+            add_line(p, n, code[n].a.n);
+        else
+            n++;
+    }
+    p->captures_n = captures_n;
+    code[n++] = (insn_t){.op = OPCODE(INSTRUCTION_EXIT, 15)};  // in case control runs off the end
+
+    p->code.p = realloc(code, n * sizeof(insn_t));
+    p->code.n = n;
+
+    for (insn_t* i = p->code.p; i < p->code.p + p->code.n; i++) {
+        switch (i->op) {
+            case OPCODE(INSTRUCTION_DATA, DATA_JUMP):
+            case OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPZ):
+            case OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPNZ):
+            case OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL):
+                i->a.target = resolve_offset(p, i->a.n);
+                break;
+            case OPCODE(INSTRUCTION_CONTROL, CONTROL_CLOJURE):
+                resolve_offset(p, i->a.n);  // entry stays an offset: it is stored in the closure
+                i->c.ptr = &p->captures[i->c.n];
+                break;
+            case OPCODE(INSTRUCTION_DATA, DATA_STRING):
+                i->b.ptr = p->literals[p->literals_n++] = Bliteral(i->a.str);
+                break;
+            case OPCODE(INSTRUCTION_CONTROL, CONTROL_FAIL):
+                i->c.n = get_line(p, i);  // the tiers run copies of the record
+                break;
+        }
+    }
+    verify_program(p);
+#ifndef PROFILE_SEQUENCES
+    compile_case_chains(p);
+    fuse_superinstructions(p);
+#endif
+    return p;
+}
+
+// the block is freed with the program
+static void add_code_block(program_t* p, insn_t* code, size_t n) {
+    code_block_t* b = malloc(sizeof(code_block_t));
+    if (b == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    *b = (code_block_t){.code = {.p = code, .n = n}, .next = p->code_blocks};
+    p->code_blocks = b;
+}
+
+#ifdef HAS_JIT
+static void free_jit(jit_t* jit);
+#endif
+
+void free_program(program_t* p) {
+    while (p->code_blocks != 0) {
+        code_block_t* b = p->code_blocks;
+        p->code_blocks = b->next;
+        free(b->code.p);
+        free(b);
+    }
+#ifdef HAS_JIT
+    if (p->jit != 0)
+        free_jit(p->jit);
+#endif
+    if (p->image != 0)
+        munmap(p->image, p->image_size);
+    else
+        free(p->code.p);
+    free(p->insn_of_offset);
+    free(p->captures);
+    for (size_t i = 0; i < p->literals_n; i++)
+        free(TO_DATA(p->literals[i]));
+    free(p->literals);
+    free(p->lines);
+    while (p->case_tables != 0) {
+        case_table_t* t = p->case_tables;
+        p->case_tables = t->next;
+        free(t);
+    }
+    free(p);
+}
+
+/*
+Program images. What load_program makes of the bytecode can be cached in a file:
+the records with their offsets, the captures, the lines and the case tables. The next
+run of the same bytecode, recognized by a hash of its file, maps the image and only
+copies and relocates it. Pointers are stored as indices of records, offsets in the
+string table and offsets of case tables in the image; literals are made again from
+their strings. Only offsets of records are kept: at run time the offset table is only
+used for entries of closures. Handlers and inline caches are not stored, an image is
+written before the program runs. IMAGE_VERSION has to change with anything that
+changes the output of load_program.
+*/
+#define IMAGE_MAGIC "LAMAIMG"
+#define IMAGE_VERSION 1
+#define HASH_SEED 0xcbf29ce484222325ull
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t insn_size;     /* sizeof(insn_t): images are not portable between targets */
+    uint32_t fused;         /* superinstructions and case chains are compiled          */
+    uint32_t code_n;
+    uint32_t code_size;
+    uint32_t captures_n;
+    uint32_t lines_n;
+    uint32_t tables_size;   /* bytes of the case tables                                */
+    uint32_t max_frame;
+    uint64_t bytecode_hash; /* of the whole bytecode file                              */
+    uint64_t body_hash;     /* of everything after the header                          */
+} image_header_t;
+
+_Static_assert(sizeof(image_header_t) % sizeof(void*) == 0, "records follow the header");
+
+/* A case table in an image, its slots follow it */
+typedef struct {
+    uint32_t slots_n;
+    uint32_t miss;
+    uint32_t has_strings;
+} image_table_t;
+
+typedef struct {
+    int32_t kind;
+    int32_t tag;
+    int32_t n;
+    int32_t str; /* -1 if the arm is not a string */
+    uint32_t target;
+} image_arm_t;
+
+// FNV-1a over 32-bit words, the bytes after the last whole word one by one;
+// hashing parts in turn gives the hash of the whole if the parts are whole words
+static uint64_t hash_bytes(uint64_t h, const void* p, size_t n) {
+    const uint8_t* b = p;
+    uint32_t w;
+    for (; n >= sizeof(w); b += sizeof(w), n -= sizeof(w)) {
+        memcpy(&w, b, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ull;
+    }
+    for (; n > 0; b++, n--)
+        h = (h ^ *b) * 0x100000001b3ull;
+    return h;
+}
+
+static bool is_fused(void) {
+#ifdef PROFILE_SEQUENCES
+    return false;
+#else
+    return true;
+#endif
+}
+
+// converts the pointer operands of a record to their form in an image or back;
+// the table of SUPER_CASE and the literal of STRING are left to the caller
+static void relocate_insn(program_t* p, char* strings, insn_t* i, bool to_image) {
+    operand_t* o;
+    switch (get_base_opcode(i)) {
+        case OPCODE(INSTRUCTION_DATA, DATA_JUMP):
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPZ):
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPNZ):
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL):
+            o = &i->a;
+            if (to_image)
+                *o = (operand_t){.n = o->target - p->code.p};
+            else
+                o->target = p->code.p + o->n;
+            break;
+        case OPCODE(INSTRUCTION_DATA, DATA_STRING):
+        case OPCODE(INSTRUCTION_DATA, DATA_SEXP):
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_TAG):
+            o = &i->a;
+            if (to_image)
+                *o = (operand_t){.n = o->str - strings};
+            else
+                o->str = strings + o->n;
+            break;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CLOJURE):
+            o = &i->c;
+            if (to_image)
+                *o = (operand_t){.n = (capture_t*)o->ptr - p->captures};
+            else
+                o->ptr = &p->captures[o->n];
+            break;
+        case OPCODE(INSTRUCTION_CALL, CALL_EXTERN):
+            // the function is found by its name again, the image may outlive the interpreter
+            if (to_image) {
+                i->a = (operand_t){.n = i->a.str - strings};
+                i->c = (operand_t){.n = 0};
+            } else {
+                i->a.str = strings + i->a.n;
+                i->c.ptr = (void*)find_builtin(i->a.str);
+                if (i->c.ptr == 0)
+                    failure("Unknown external function %s\n", i->a.str);
+            }
+            break;
+    }
+}
+
+static bool write_image_part(FILE* f, uint64_t* hash, const void* p, size_t n) {
+    *hash = hash_bytes(*hash, p, n);
+    return fwrite(p, 1, n, f) == n;
+}
+
+static bool write_image_body(FILE* f, program_t* p, const bytefile* bf, image_header_t* h) {
+    bool ok = true;
+    uint64_t hash = HASH_SEED;
+    h->tables_size = 0;
+    for (insn_t* i = p->code.p; ok && i < p->code.p + p->code.n; i++) {
+        insn_t r = *i;
+        relocate_insn(p, bf->string_ptr, &r, true);
+        if (get_base_opcode(&r) == OPCODE(INSTRUCTION_DATA, DATA_STRING))
+            r.b = (operand_t){.n = 0};
+        if (r.op == SUPER_CASE) {
+            const case_table_t* t = i->a.ptr;
+            r.a = (operand_t){.n = h->tables_size};
+            h->tables_size += sizeof(image_table_t) + (t->mask + 1) * sizeof(image_arm_t);
+        }
+        ok = write_image_part(f, &hash, &r, sizeof(r));
+    }
+    uint32_t* offsets = malloc(p->code.n * sizeof(uint32_t));
+    if (offsets == 0)
+        return false;
+    for (size_t k = 0; k < p->code.n; k++)
+        offsets[k] = p->code_size;  // the EXIT at the end has none
+    for (size_t o = 0; o < p->code_size; o++) {
+        // LINEs resolve to the record after them, so the last offset is its own
+        if (p->insn_of_offset[o] >= 0)
+            offsets[p->insn_of_offset[o]] = o;
+    }
+    ok = ok && write_image_part(f, &hash, offsets, p->code.n * sizeof(uint32_t));
+    free(offsets);
+    ok = ok && write_image_part(f, &hash, p->captures, p->captures_n * sizeof(capture_t)) &&
+         write_image_part(f, &hash, p->lines, p->lines_n * sizeof(line_entry_t));
+    for (insn_t* i = p->code.p; ok && i < p->code.p + p->code.n; i++) {
+        if (i->op != SUPER_CASE)
+            continue;
+        const case_table_t* t = i->a.ptr;
+        image_table_t it = {.slots_n = t->mask + 1,
+                            .miss = t->miss - p->code.p,
+                            .has_strings = t->has_strings};
+        ok = write_image_part(f, &hash, &it, sizeof(it));
+        for (const case_arm_t* a = t->arms; ok && a < t->arms + t->mask + 1; a++) {
+            image_arm_t ia = {
+                .kind = a->kind,
+                .tag = a->tag,
+                .n = a->n,
+                .str = a->str == 0 ? -1 : a->str - bf->string_ptr,
+                .target = a->target == 0 ? 0 : a->target - p->code.p,
+            };
+            ok = write_image_part(f, &hash, &ia, sizeof(ia));
+        }
+    }
+    h->body_hash = hash;
+    return ok;
+}
+
+// writes the image of a program that has not run yet; it is a cache, so failures are ignored
+static void save_image(const char* path, program_t* p, const bytefile* bf, uint64_t hash) {
+    char* tmp = malloc(strlen(path) + 32);
+    if (tmp == 0)
+        return;
+    // renamed when it is complete, so no reader sees a partial image
+    sprintf(tmp, "%s.%d.tmp", path, (int)getpid());
+    FILE* f = fopen(tmp, "wb");
+    if (f == 0) {
+        free(tmp);
+        return;
+    }
+    image_header_t h = {
+        .magic = IMAGE_MAGIC,
+        .version = IMAGE_VERSION,
+        .insn_size = sizeof(insn_t),
+        .fused = is_fused(),
+        .code_n = p->code.n,
+        .code_size = p->code_size,
+        .captures_n = p->captures_n,
+        .lines_n = p->lines_n,
+        .max_frame = p->max_frame,
+        .bytecode_hash = hash,
+    };
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && write_image_body(f, p, bf, &h) &&
+              fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0)
+        unlink(tmp);
+    free(tmp);
+}
+
+static void* copy_image_part(const uint8_t** from, size_t n) {
+    void* p = malloc(n + 1);  // never 0 bytes
+    if (p == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    memcpy(p, *from, n);
+    *from += n;
+    return p;
+}
+
+static program_t* load_image_body(image_header_t* h, const bytefile* bf) {
+    program_t* p = malloc(sizeof(program_t));
+    if (p == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    // the records are used in place: the mapping is private, pages are copied when written
+    p->code.n = h->code_n;
+    p->code.p = (insn_t*)(h + 1);
+    const uint8_t* from = (const uint8_t*)(p->code.p + h->code_n);
+    p->code_size = h->code_size;
+    p->insn_of_offset = malloc((h->code_size + 1) * sizeof(int32_t));
+    if (p->insn_of_offset == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    memset(p->insn_of_offset, 0xFF, h->code_size * sizeof(int32_t));  // -1
+    const uint32_t* offsets = (const uint32_t*)from;
+    for (size_t k = 0; k < h->code_n; k++) {
+        if (offsets[k] < h->code_size)
+            p->insn_of_offset[offsets[k]] = k;
+    }
+    from += h->code_n * sizeof(uint32_t);
+    p->captures_n = h->captures_n;
+    p->captures = copy_image_part(&from, h->captures_n * sizeof(capture_t));
+    p->lines_n = h->lines_n;
+    p->lines = copy_image_part(&from, h->lines_n * sizeof(line_entry_t));
+    p->literals = malloc(h->code_n * sizeof(void*));
+    if (p->literals == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    p->literals_n = 0;
+    p->global_area_size = bf->global_area_size;
+    p->max_frame = h->max_frame;
+    p->code_blocks = 0;
+    p->case_tables = 0;
+    p->jit = 0;
+    p->image = (void*)h;
+
+    for (insn_t* i = p->code.p; i < p->code.p + p->code.n; i++) {
+        relocate_insn(p, bf->string_ptr, i, false);
+        if (get_base_opcode(i) == OPCODE(INSTRUCTION_DATA, DATA_STRING))
+            i->b.ptr = p->literals[p->literals_n++] = Bliteral(i->a.str);
+        if (i->op != SUPER_CASE)
+            continue;
+        const image_table_t* it = (const image_table_t*)(from + i->a.n);
+        const image_arm_t* ia = (const image_arm_t*)(it + 1);
+        case_table_t* t = calloc(1, sizeof(case_table_t) + it->slots_n * sizeof(case_arm_t));
+        if (t == 0)
+            failure("*** FAILURE: unable to allocate memory.\n");
+        *t = (case_table_t){.next = p->case_tables,
+                            .miss = p->code.p + it->miss,
+                            .has_strings = it->has_strings,
+                            .mask = it->slots_n - 1};
+        for (size_t k = 0; k < it->slots_n; k++) {
+            if (ia[k].kind == 0)
+                continue;
+            t->arms[k] = (case_arm_t){
+                .kind = ia[k].kind,
+                .tag = ia[k].tag,
+                .n = ia[k].n,
+                .str = ia[k].str < 0 ? 0 : bf->string_ptr + ia[k].str,
+                .target = p->code.p + ia[k].target,
+            };
+        }
+        p->case_tables = t;
+        i->a.ptr = t;
+    }
+    return p;
+}
+
+// the program from its image, 0 if there is no image of this bytecode
+static program_t* load_image(const char* path, const bytefile* bf, uint64_t hash) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1)
+        return 0;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(image_header_t)) {
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    void* mapping = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return 0;
+    image_header_t* h = mapping;
+    size_t body_size = (size_t)h->code_n * (sizeof(insn_t) + sizeof(uint32_t)) +
+                       h->captures_n * sizeof(capture_t) + h->lines_n * sizeof(line_entry_t) +
+                       h->tables_size;
+    if (memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) == 0 && h->version == IMAGE_VERSION &&
+        h->insn_size == sizeof(insn_t) && h->fused == is_fused() &&
+        h->bytecode_hash == hash && h->code_size == bf->code_size &&
+        size == sizeof(image_header_t) + body_size &&
+        hash_bytes(HASH_SEED, h + 1, body_size) == h->body_hash) {
+        program_t* p = load_image_body(h, bf);
+        p->image_size = size;
+        return p;
+    }
+    munmap(mapping, size);
+    return 0;
+}
+
+// load_program through an image next to the bytecode file, or in cache_dir if it is not 0
+program_t* load_cached_program(bytefile* bf, const char* fname, const char* cache_dir) {
+    uint64_t hash = hash_bytes(HASH_SEED, bf->mapping, bf->mapping_size);
+    char* path = malloc(strlen(fname) + (cache_dir == 0 ? 0 : strlen(cache_dir)) + 32);
+    if (path == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    if (cache_dir == 0)
+        sprintf(path, "%s.img", fname);
+    else
+        sprintf(path, "%s/%016llx.img", cache_dir, (unsigned long long)hash);
+    program_t* p = load_image(path, bf, hash);
+    if (p == 0) {
+        p = load_program(bf);
+        save_image(path, p, bf, hash);
+    }
+    free(path);
+    return p;
+}
+
+/*
+Register tier.
+
+A function that gets hot is translated into a register-based three-address IR.
+The stack depth of every instruction of the body is known statically, so every
+operand stack slot of the frame, as well as arguments and locals, is at a fixed
+offset from bp and serves as a register. Values are still stored in the same
+slots the stack code uses, so the GC sees the frame between the stack top and
+bottom of the isolate as before: runtime calls that can allocate run in stack mode,
+and all pending values are written to their slots before entering it.
+
+The translator keeps a virtual stack: a value loaded from a variable or a
+constant is not copied to its stack slot until something needs it there, which
+turns LD/CONST/BINOP/ST/DROP chains into single register instructions.
+Instructions without a register form are copied and run in stack mode between
+REG_ENTER and REG_LEAVE, which set sp and the cached top for the static depth.
+*/
+
+typedef enum {
+    VALUE_TEMP,  /* in its own stack slot */
+    VALUE_SLOT,  /* in the slot of a variable of the frame */
+    VALUE_CONST, /* a boxed constant */
+} value_kind_t;
+
+typedef struct {
+    value_kind_t kind;
+    int32_t n; /* offset of the slot from bp or the boxed constant */
+} value_t;
+
+typedef struct {
+    context_t* c;
+    const insn_t* body; /* BEGIN .. END of the function in the stack code */
+    size_t n;
+    int args_n;
+    int locals_n;
+    bool is_closure;
+    int* depth;            /* stack depth before every instruction, -1 if unreachable */
+    bool* is_label;        /* instructions that are jump targets */
+    int32_t* out_of_insn;  /* index of the first IR record of every instruction */
+    insn_t* out;
+    size_t out_n, out_cap;
+    value_t* values; /* the virtual stack */
+    int values_n;
+    int32_t last_def; /* the last record if it defines the top value, -1 otherwise */
+    bool stack_mode;  /* sp and the cached top are valid for the current depth */
+    bool top_flushed; /* in stack mode, the cached top is also in its slot */
+} reg_translator_t;
+
+// sets the depth of an instruction reached with the given one, false if they disagree
+static bool merge_depth(reg_translator_t* t, size_t k, int d, size_t* worklist, size_t* w) {
+    if (t->depth[k] < 0) {
+        t->depth[k] = d;
+        worklist[(*w)++] = k;
+        return true;
+    }
+    return t->depth[k] == d;
+}
+
+// computes the stack depth before every instruction of the body, false if it is not static
+static bool analyze_stack_depths(reg_translator_t* t) {
+    size_t* worklist = malloc(t->n * sizeof(size_t));
+    if (worklist == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    size_t w = 0;
+    bool ok = true;
+    for (size_t k = 0; k < t->n; k++) {
+        t->depth[k] = -1;
+        t->is_label[k] = false;
+    }
+    t->depth[1] = 0;  // the body starts right after BEGIN
+    worklist[w++] = 1;
+    while (ok && w > 0) {
+        size_t k = worklist[--w];
+        const insn_t* i = &t->body[k];
+        uint16_t op = get_base_opcode(i);
+        int pops, pushes;
+        if (!get_stack_effect(i, op, &pops, &pushes) || t->depth[k] < pops) {
+            ok = false;
+            break;
+        }
+        int d = t->depth[k] - pops + pushes;
+        if (is_branch(op)) {
+            ptrdiff_t target = i->a.target - t->body;
+            if (target < 1 || target >= t->n) {
+                ok = false;
+                break;
+            }
+            t->is_label[target] = true;
+            ok = merge_depth(t, target, d, worklist, &w);
+        }
+        if (ok && !is_terminal(op))
+            ok = k + 1 < t->n && merge_depth(t, k + 1, d, worklist, &w);
+    }
+    free(worklist);
+    return ok;
+}
+
+static insn_t* emit(reg_translator_t* t, insn_t i) {
+    if (t->out_n == t->out_cap) {
+        t->out_cap = t->out_cap * 2 + 16;
+        t->out = realloc(t->out, t->out_cap * sizeof(insn_t));
+        if (t->out == 0)
+            failure("*** FAILURE: unable to allocate memory.\n");
+    }
+    t->out[t->out_n] = i;
+    return &t->out[t->out_n++];
+}
+
+// offset from bp of the stack slot of the value at the given depth
+static int32_t get_temp_offset(reg_translator_t* t, int d) { return -t->locals_n - 1 - d; }
+
+static bool get_var_offset(reg_translator_t* t, MEM mem, int idx, int32_t* offset) {
+    if (mem == MEM_LOCAL && 0 <= idx && idx < t->locals_n) {
+        *offset = -t->locals_n + idx;
+        return true;
+    }
+    if (mem == MEM_ARG && 0 <= idx && idx < t->args_n) {
+        *offset = t->args_n - 1 - idx;
+        return true;
+    }
+    return false;
+}
+
+static void push_value(reg_translator_t* t, value_kind_t kind, int32_t n) {
+    t->values[t->values_n++] = (value_t){.kind = kind, .n = n};
+}
+
+static value_t pop_value(reg_translator_t* t) { return t->values[--t->values_n]; }
+
+// writes the value at the given depth to its stack slot
+static void materialize(reg_translator_t* t, int d) {
+    value_t* v = &t->values[d];
+    int32_t temp = get_temp_offset(t, d);
+    if (v->kind == VALUE_SLOT)
+        emit(t, (insn_t){.op = REG_MOV, .a.n = temp, .b.n = v->n});
+    else if (v->kind == VALUE_CONST)
+        emit(t, (insn_t){.op = REG_CONST, .a.n = temp, .b.n = v->n});
+    *v = (value_t){.kind = VALUE_TEMP, .n = temp};
+}
+
+static void flush_values(reg_translator_t* t) {
+    for (int d = 0; d < t->values_n; d++)
+        materialize(t, d);
+    t->last_def = -1;
+}
+
+// the value as a frame slot, a constant is written to its stack slot first
+static int32_t get_value_slot(reg_translator_t* t, int d) {
+    if (t->values[d].kind == VALUE_CONST)
+        materialize(t, d);
+    return t->values[d].n;
+}
+
+static void leave_stack_mode(reg_translator_t* t) {
+    if (t->stack_mode && !t->top_flushed)
+        emit(t, (insn_t){.op = REG_LEAVE, .a.n = get_temp_offset(t, t->values_n - 1)});
+    t->stack_mode = false;
+}
+
+// the top value is computed by a new record into its stack slot
+static void push_def(reg_translator_t* t, insn_t i) {
+    int d = t->values_n;
+    i.a.n = get_temp_offset(t, d);
+    emit(t, i);
+    push_value(t, VALUE_TEMP, i.a.n);
+    t->last_def = t->out_n - 1;
+}
+
+static void translate_store(reg_translator_t* t, MEM mem, int idx) {
+    int top = t->values_n - 1;
+    int32_t var;
+    if (!get_var_offset(t, mem, idx, &var)) {
+        insn_t i = {.op = mem == MEM_GLOBAL ? REG_STORE_GLOBAL : REG_STORE_CLOSED, .a.n = idx};
+        i.b.n = get_value_slot(t, top);
+        emit(t, i);
+        t->last_def = -1;
+        return;
+    }
+    value_t v = t->values[top];
+    if (v.kind == VALUE_SLOT && v.n == var)
+        return;
+    // values still read from the variable get their old contents
+    for (int d = 0; d < top; d++) {
+        if (t->values[d].kind == VALUE_SLOT && t->values[d].n == var)
+            materialize(t, d);
+    }
+    if (v.kind == VALUE_TEMP && t->last_def == t->out_n - 1) {
+        // the value is written straight to the variable instead of its stack slot
+        t->out[t->last_def].a.n = var;
+        t->values[top] = (value_t){.kind = VALUE_SLOT, .n = var};
+    } else if (v.kind == VALUE_CONST) {
+        emit(t, (insn_t){.op = REG_CONST, .a.n = var, .b.n = v.n});
+    } else {
+        emit(t, (insn_t){.op = REG_MOV, .a.n = var, .b.n = v.n});
+    }
+    t->last_def = -1;
+}
+
+static void translate_binop(reg_translator_t* t, uint8_t l) {
+    int d = t->values_n - 2;
+    insn_t i = {.op = REG_BINOP, .sub = l};
+    i.b.n = get_value_slot(t, d);
+    if (t->values[d + 1].kind == VALUE_CONST) {
+        i.op = REG_BINOP_IMM;
+        i.c.n = UNBOX(t->values[d + 1].n);
+    } else {
+        i.c.n = t->values[d + 1].n;
+    }
+    t->values_n -= 2;
+    push_def(t, i);
+}
+
+// jump targets are kept as indices in the body until all records are emitted
+static void translate_branch(reg_translator_t* t, uint16_t op, size_t target) {
+    if (op == OPCODE(INSTRUCTION_DATA, DATA_JUMP)) {
+        flush_values(t);
+        emit(t, (insn_t){.op = REG_JUMP, .a.n = target});
+        return;
+    }
+    bool jz = op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPZ);
+    value_t v = pop_value(t);
+    flush_values(t);
+    if (v.kind == VALUE_CONST) {
+        if ((UNBOX(v.n) == 0) == jz)
+            emit(t, (insn_t){.op = REG_JUMP, .a.n = target});
+        return;
+    }
+    emit(t, (insn_t){.op = jz ? REG_JZ : REG_JNZ, .a.n = v.n, .b.n = target});
+}
+
+// variables the tier can address, the rest is left to the checks of the stack code
+static bool is_supported_var(reg_translator_t* t, MEM mem, int idx) {
+    int32_t offset;
+    switch (mem) {
+        case MEM_GLOBAL:
+            return 0 <= idx && idx < t->c->globals.n;
+        case MEM_CLOSED:
+            return t->is_closure && 0 <= idx;
+        default:
+            return get_var_offset(t, mem, idx, &offset);
+    }
+}
+
+static bool translate_insn(reg_translator_t* t, size_t k) {
+    const insn_t* i = &t->body[k];
+    uint16_t op = get_base_opcode(i);
+    uint8_t h = op >> 4, l = op & 0x0F;
+    int32_t var;
+    if (h == INSTRUCTION_BINOP || h == INSTRUCTION_LD || h == INSTRUCTION_ST || is_branch(op) ||
+        op == OPCODE(INSTRUCTION_DATA, DATA_CONST) || op == OPCODE(INSTRUCTION_DATA, DATA_DROP) ||
+        op == OPCODE(INSTRUCTION_DATA, DATA_DUP)) {
+        if ((h == INSTRUCTION_LD || h == INSTRUCTION_ST) && !is_supported_var(t, l, i->a.n))
+            return false;
+        leave_stack_mode(t);
+        if (h == INSTRUCTION_BINOP) {
+            translate_binop(t, l);
+        } else if (h == INSTRUCTION_LD && get_var_offset(t, l, i->a.n, &var)) {
+            push_value(t, VALUE_SLOT, var);
+        } else if (h == INSTRUCTION_LD) {
+            push_def(t, (insn_t){.op = l == MEM_GLOBAL ? REG_LOAD_GLOBAL : REG_LOAD_CLOSED,
+                                 .b.n = i->a.n});
+        } else if (h == INSTRUCTION_ST) {
+            translate_store(t, l, i->a.n);
+        } else if (is_branch(op)) {
+            translate_branch(t, op, i->a.target - t->body);
+        } else if (l == DATA_CONST) {
+            push_value(t, VALUE_CONST, BOX(i->a.n));
+        } else if (l == DATA_DROP) {
+            pop_value(t);
+        } else if (t->values[t->values_n - 1].kind == VALUE_TEMP) {  // DUP
+            push_def(t, (insn_t){.op = REG_MOV, .b.n = t->values[t->values_n - 1].n});
+        } else {
+            t->values[t->values_n] = t->values[t->values_n - 1];
+            t->values_n++;
+        }
+        return true;
+    }
+
+    int pops, pushes;
+    get_stack_effect(i, op, &pops, &pushes);
+    bool is_call = op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL) ||
+                   op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CALLC);
+    int32_t sp = get_temp_offset(t, t->values_n - 1);
+    if (!t->stack_mode && (op == OPCODE(INSTRUCTION_DATA, DATA_END) ||
+                           op == OPCODE(INSTRUCTION_DATA, DATA_RET))) {
+        // the frame is dropped, so only the returned value is needed
+        emit(t, (insn_t){.op = REG_END, .a.n = get_value_slot(t, t->values_n - 1), .b.n = sp});
+        t->values_n--;
+        return true;
+    }
+    // tail calls stay fused, they leave the function for good
+    bool is_tail_call = i->op == SUPER_TAIL_CALL || i->op == SUPER_TAIL_CALLC;
+    insn_t* copy;
+    if (!t->stack_mode) {
+        flush_values(t);
+        // CALLC keeps its inline cache in b and c, so it is entered like any other instruction
+        if (op != OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL) || is_tail_call)
+            emit(t, (insn_t){.op = REG_ENTER, .a.n = sp});
+        copy = emit(t, *i);
+        copy->op = is_tail_call ? i->op : op;
+        if (op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL) && !is_tail_call) {
+            copy->op = REG_CALL;
+            copy->b.n = sp;
+        }
+        t->stack_mode = true;
+    } else {
+        copy = emit(t, *i);
+        copy->op = is_tail_call ? i->op : op;
+    }
+    t->top_flushed = is_call;  // END writes the returned value to the slot as well
+    t->values_n -= pops;
+    for (int p = 0; p < pushes; p++)
+        push_value(t, VALUE_TEMP, get_temp_offset(t, t->values_n));
+    t->last_def = -1;
+    return true;
+}
+
+static void free_translator(reg_translator_t* t) {
+    free(t->depth);
+    free(t->is_label);
+    free(t->out_of_insn);
+    free(t->values);
+}
+
+// the number of records from BEGIN to the last instruction that does not fall through before
+// the next function, so blocks after the first END (such as a FAIL of a match) are included
+static size_t get_function_length(const context_t* c, const insn_t* begin) {
+    const insn_t* end = c->code.p + c->code.n;
+    size_t n = 0;
+    for (const insn_t* i = begin + 1; i != end; i++) {
+        uint16_t op = get_base_opcode(i);
+        if (op == OPCODE(INSTRUCTION_CONTROL, CONTROL_BEGIN) ||
+            op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CBEGIN) || (op >> 4) == INSTRUCTION_EXIT)
+            break;
+        if (is_terminal(op))
+            n = i - begin + 1;
+    }
+    return n;
+}
+
+/* Translates the function starting at the given BEGIN to the register tier.
+   Returns the entry of the translated body, or 0 if the function is not supported. */
+static insn_t* translate_function(context_t* c, insn_t* begin, const void* const* dispatch_table) {
+    reg_translator_t t = {
+        .c = c,
+        .body = begin,
+        .args_n = begin->a.n,
+        .locals_n = begin->b.n,
+        .is_closure = begin->op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CBEGIN),
+        .last_def = -1,
+    };
+    t.n = get_function_length(c, begin);
+    if (t.n == 0)
+        return 0;
+    t.depth = malloc(t.n * sizeof(int));
+    t.is_label = malloc(t.n * sizeof(bool));
+    t.out_of_insn = malloc(t.n * sizeof(int32_t));
+    t.values = malloc((t.n + 1) * sizeof(value_t));  // every instruction pushes at most one value
+    if (t.depth == 0 || t.is_label == 0 || t.out_of_insn == 0 || t.values == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    if (!analyze_stack_depths(&t)) {
+        free_translator(&t);
+        return 0;
+    }
+
+    bool falls_through = true;
+    for (size_t k = 1; k < t.n; k++) {
+        if (t.depth[k] < 0)
+            continue;  // unreachable
+        if (t.is_label[k]) {
+            // control flow merges here, all values are in their stack slots
+            if (falls_through) {
+                leave_stack_mode(&t);
+                flush_values(&t);
+            }
+            t.stack_mode = false;
+            t.values_n = 0;
+            for (int d = 0; d < t.depth[k]; d++)
+                push_value(&t, VALUE_TEMP, get_temp_offset(&t, d));
+            t.last_def = -1;
+        }
+        t.out_of_insn[k] = t.out_n;
+        if (!translate_insn(&t, k)) {
+            free(t.out);
+            free_translator(&t);
+            return 0;
+        }
+        falls_through = !is_terminal(get_base_opcode(&t.body[k]));
+    }
+
+    for (insn_t* i = t.out; i < t.out + t.out_n; i++) {
+        if (i->op == REG_JUMP)
+            i->a.target = &t.out[t.out_of_insn[i->a.n]];
+        else if (i->op == REG_JZ || i->op == REG_JNZ)
+            i->b.target = &t.out[t.out_of_insn[i->b.n]];
+        i->handler = dispatch_table[i->op];
+    }
+    add_code_block(c->program, t.out, t.out_n);
+    free_translator(&t);
+    return t.out;
+}
+
+#ifdef HAS_JIT
+/*
+Baseline JIT.
+
+A function is compiled to i386 machine code on its first call, one fixed template
+per instruction of the body. The templates work on the same operand stack and
+frame as the handlers: esi holds sp, edi holds bp and ebx the context, and every
+value stays in its stack slot. They call the same runtime functions the handlers
+do and write the stack top of the isolate before the ones that can allocate, so the GC sees
+exactly the roots it sees under the interpreter.
+
+CALL, CALLC, END, RET and FAIL are left to the interpreter: the code stores the
+address of a copy of the instruction to ip and leaves. The copy is followed by a
+JIT_RESUME record that enters the code right after the instruction, and as a call
+pushes that record as its return address, compiled and interpreted frames mix.
+*/
+
+#define JIT_CHUNK_SIZE (1 << 20)
+#define JIT_MAX_TEMPLATE_SIZE 96 /* bytes of code of one instruction at most */
+#define JIT_MAX_CAPTURE_SIZE 24  /* bytes of code loading one captured variable at most */
+
+/* A piece of executable memory */
+typedef struct jit_chunk {
+    uint8_t* p;
+    size_t size, used;
+    struct jit_chunk* next;
+} jit_chunk_t;
+
+struct jit {
+    jit_chunk_t* chunks;                          /* the current chunk goes first */
+    void (*enter)(context_t* c, const void* code); /* runs code until it leaves */
+    const uint8_t* leave;                         /* the code jumps here to leave */
+};
+
+enum {
+    X86_EAX = 0,
+    X86_ECX,
+    X86_EDX,
+    X86_EBX,
+    X86_ESP,
+    X86_EBP,
+    X86_ESI,
+    X86_EDI,
+    X86_ABSOLUTE = -1, /* no base register, the displacement is an address */
+};
+
+/* A jump to an instruction of the body, patched when all of them are emitted */
+typedef struct {
+    uint8_t* at; /* the rel32 field */
+    size_t target;
+} jit_fixup_t;
+
+typedef struct {
+    context_t* c;
+    jit_t* jit;
+    const insn_t* body; /* BEGIN .. END of the function */
+    size_t n;
+    int args_n;
+    int locals_n;
+    bool is_closure;
+    uint8_t* p;              /* the next byte of the code */
+    uint8_t** code_of_insn;  /* start of the code of every instruction */
+    jit_fixup_t* fixups;     /* at most one per instruction */
+    size_t fixups_n;
+    insn_t* exits; /* pairs of an instruction left to the interpreter and its JIT_RESUME */
+    size_t exits_n;
+} jit_compiler_t;
+
+static void free_jit(jit_t* jit) {
+    while (jit->chunks != 0) {
+        jit_chunk_t* chunk = jit->chunks;
+        jit->chunks = chunk->next;
+        munmap(chunk->p, chunk->size);
+        free(chunk);
+    }
+    free(jit);
+}
+
+// a chunk is writable only while code is emitted into it, and executable otherwise
+static void protect_jit_chunk(jit_chunk_t* chunk, int prot) {
+    if (mprotect(chunk->p, chunk->size, prot) != 0)
+        failure("*** FAILURE: unable to change the protection of compiled code.\n");
+}
+
+// returns at least size bytes of writable memory, they are taken by commit_jit_code
+static uint8_t* allocate_jit_code(jit_t* jit, size_t size) {
+    jit_chunk_t* chunk = jit->chunks;
+    if (chunk == 0 || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > JIT_CHUNK_SIZE ? size : JIT_CHUNK_SIZE;
+        void* p = mmap(0, chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        chunk = malloc(sizeof(jit_chunk_t));
+        if (p == MAP_FAILED || chunk == 0)
+            failure("*** FAILURE: unable to allocate memory.\n");
+        *chunk = (jit_chunk_t){.p = p, .size = chunk_size, .used = 0, .next = jit->chunks};
+        jit->chunks = chunk;
+    } else {
+        protect_jit_chunk(chunk, PROT_READ | PROT_WRITE);
+    }
+    return chunk->p + chunk->used;
+}
+
+// takes the code up to end and makes the chunk executable again
+static void commit_jit_code(jit_t* jit, const uint8_t* end) {
+    jit->chunks->used = end - jit->chunks->p;
+    protect_jit_chunk(jit->chunks, PROT_READ | PROT_EXEC);
+}
+
+/* Machine code emitters */
+
+#define EMIT(j, ...) \
+    emit_bytes(j, (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit_bytes(jit_compiler_t* j, const uint8_t* bytes, size_t n) {
+    memcpy(j->p, bytes, n);
+    j->p += n;
+}
+
+static void emit32(jit_compiler_t* j, uint32_t v) {
+    memcpy(j->p, &v, sizeof(v));
+    j->p += sizeof(v);
+}
+
+// the rel32 field of a jump or a call that ends right after it
+static void emit_rel32(jit_compiler_t* j, const void* target) {
+    emit32(j, (uint32_t)(size_t)target - (uint32_t)(size_t)(j->p + 4));
+}
+
+// op reg, [base + disp]; base is never esp, so no SIB byte is needed
+static void emit_mem(jit_compiler_t* j, uint8_t op, int reg, int base, int32_t disp) {
+    if (base == X86_ABSOLUTE) {
+        EMIT(j, op, reg << 3 | 5);
+        emit32(j, disp);
+    } else if (-128 <= disp && disp < 128) {
+        EMIT(j, op, 0x40 | reg << 3 | base, (uint8_t)disp);
+    } else {
+        EMIT(j, op, 0x80 | reg << 3 | base);
+        emit32(j, disp);
+    }
+}
+
+static void emit_load(jit_compiler_t* j, int reg, int base, int32_t disp) {
+    emit_mem(j, 0x8B, reg, base, disp);
+}
+
+static void emit_store(jit_compiler_t* j, int reg, int base, int32_t disp) {
+    emit_mem(j, 0x89, reg, base, disp);
+}
+
+static void emit_lea(jit_compiler_t* j, int reg, int base, int32_t disp) {
+    emit_mem(j, 0x8D, reg, base, disp);
+}
+
+static void emit_store_imm(jit_compiler_t* j, int base, int32_t disp, uint32_t v) {
+    emit_mem(j, 0xC7, 0, base, disp);
+    emit32(j, v);
+}
+
+static void emit_push_mem(jit_compiler_t* j, int base, int32_t disp) {
+    emit_mem(j, 0xFF, 6, base, disp);
+}
+
+static void emit_push_imm(jit_compiler_t* j, uint32_t v) {
+    EMIT(j, 0x68);
+    emit32(j, v);
+}
+
+static void emit_push_reg(jit_compiler_t* j, int reg) { EMIT(j, 0x50 + reg); }
+
+// the stack is aligned to 16 bytes at every call, as the i386 System V ABI requires
+static int get_call_padding(int args_n) { return (16 - args_n * 4 % 16) % 16; }
+
+// arguments are pushed between emit_call_begin and emit_call_end, the last one first
+static void emit_call_begin(jit_compiler_t* j, int args_n) {
+    if (get_call_padding(args_n) != 0)
+        EMIT(j, 0x83, 0xEC, get_call_padding(args_n));  // sub esp, padding
+}
+
+static void emit_call_end(jit_compiler_t* j, const void* f, int args_n) {
+    EMIT(j, 0xE8);
+    emit_rel32(j, f);
+    EMIT(j, 0x83, 0xC4, get_call_padding(args_n) + args_n * 4);  // add esp, ...
+}
+
+/* Operand stack templates: esi points to the top slot like c->sp */
+
+// drops n slots, a negative n reserves them
+static void emit_drop(jit_compiler_t* j, int n) {
+    if (n != 0)
+        emit_lea(j, X86_ESI, X86_ESI, n * 4);
+}
+
+static void emit_push_stack(jit_compiler_t* j, int reg) {
+    emit_drop(j, -1);
+    emit_store(j, reg, X86_ESI, 0);
+}
+
+static void emit_set_top(jit_compiler_t* j, int reg) { emit_store(j, reg, X86_ESI, 0); }
+
+// the same as sync_stack, the slots are always up to date; uses ecx
+static void emit_sync_stack(jit_compiler_t* j) {
+    emit_lea(j, X86_ECX, X86_ESI, -4);
+    emit_store(j, X86_ECX, X86_ABSOLUTE, (int32_t)(size_t)&j->c->isolate->gc_stack_top);
+}
+
+// a jump with the given condition code, 0 for an unconditional one, to the instruction at target
+static bool emit_branch(jit_compiler_t* j, uint8_t cc, const insn_t* target) {
+    if (target <= j->body || target >= j->body + j->n)
+        return false;  // a jump out of the function is not supported
+    if (cc == 0)
+        EMIT(j, 0xE9);
+    else
+        EMIT(j, 0x0F, cc);
+    j->fixups[j->fixups_n++] = (jit_fixup_t){.at = j->p, .target = target - j->body};
+    emit32(j, 0);
+    return true;
+}
+
+// a copy of the instruction runs in the interpreter, which comes back through the resume record
+static void emit_exit(jit_compiler_t* j, const insn_t* i) {
+    insn_t* copy = &j->exits[j->exits_n++];
+    insn_t* resume = &j->exits[j->exits_n++];
+    *copy = *i;
+    if (i->op != SUPER_TAIL_CALL && i->op != SUPER_TAIL_CALLC)
+        copy->op = get_base_opcode(i);  // a tail call does not come back, so it stays fused
+    emit_store_imm(j, X86_EBX, offsetof(context_t, ip), (uint32_t)(size_t)copy);
+    EMIT(j, 0xE9);
+    emit_rel32(j, j->jit->leave);
+    *resume = (insn_t){.op = JIT_RESUME, .a.ptr = j->p};
+}
+
+// the operand of a variable: locals and arguments are at fixed offsets from bp,
+// the cells of the closure are loaded to edx
+static bool emit_var(jit_compiler_t* j, MEM mem, int idx, int* base, int32_t* disp) {
+    if (idx < 0)
+        return false;
+    switch (mem) {
+        case MEM_GLOBAL:
+            *base = X86_ABSOLUTE;
+            *disp = (int32_t)(size_t)&j->c->globals.p[idx];
+            return idx < j->c->globals.n;
+        case MEM_LOCAL:
+            *base = X86_EDI;
+            *disp = (idx - j->locals_n) * 4;
+            return idx < j->locals_n;
+        case MEM_ARG:
+            *base = X86_EDI;
+            *disp = (j->args_n - 1 - idx) * 4;
+            return idx < j->args_n;
+        case MEM_CLOSED:
+            if (!j->is_closure)
+                return false;
+            emit_load(j, X86_EDX, X86_EDI, j->args_n * 4);
+            *base = X86_EDX;
+            *disp = (1 + idx) * 4;
+            return true;
+    }
+    return false;
+}
+
+static void compile_binop(jit_compiler_t* j, uint8_t l) {
+    static const uint8_t setcc[] = {[6] = 0x9C, [7] = 0x9E, [8] = 0x9F, [9] = 0x9D,
+                                    [10] = 0x94, [11] = 0x95};
+    emit_load(j, X86_EAX, X86_ESI, 4);
+    emit_load(j, X86_ECX, X86_ESI, 0);
+    EMIT(j, 0xD1, 0xF8, 0xD1, 0xF9);  // sar eax, 1; sar ecx, 1
+    switch (l) {
+        case 1:
+            EMIT(j, 0x01, 0xC8);  // add eax, ecx
+            break;
+        case 2:
+            EMIT(j, 0x29, 0xC8);  // sub eax, ecx
+            break;
+        case 3:
+            EMIT(j, 0x0F, 0xAF, 0xC1);  // imul eax, ecx
+            break;
+        case 4:
+            EMIT(j, 0x99, 0xF7, 0xF9);  // cdq; idiv ecx
+            break;
+        case 5:
+            EMIT(j, 0x99, 0xF7, 0xF9, 0x89, 0xD0);  // cdq; idiv ecx; mov eax, edx
+            break;
+        case 12:
+            // test eax, eax; setne al; test ecx, ecx; setne cl; and al, cl; movzx eax, al
+            EMIT(j, 0x85, 0xC0, 0x0F, 0x95, 0xC0, 0x85, 0xC9, 0x0F, 0x95, 0xC1, 0x20, 0xC8);
+            EMIT(j, 0x0F, 0xB6, 0xC0);
+            break;
+        case 13:
+            EMIT(j, 0x09, 0xC8, 0x0F, 0x95, 0xC0, 0x0F, 0xB6, 0xC0);  // or; setne al; movzx
+            break;
+        default:
+            EMIT(j, 0x39, 0xC8, 0x0F, setcc[l], 0xC0, 0x0F, 0xB6, 0xC0);  // cmp; setcc al; movzx
+            break;
+    }
+    EMIT(j, 0x8D, 0x44, 0x00, 0x01);  // lea eax, [eax + eax + 1]: box the result
+    emit_drop(j, 1);
+    emit_set_top(j, X86_EAX);
+}
+
+// the result of a call to f with the top as the only argument replaces the top
+static void compile_unary_call(jit_compiler_t* j, const void* f) {
+    emit_call_begin(j, 1);
+    emit_push_mem(j, X86_ESI, 0);
+    emit_call_end(j, f, 1);
+    emit_set_top(j, X86_EAX);
+}
+
+// calls gc_write_barrier for the store of eax to the variable at base + disp, unless eax
+// holds a number
+static void compile_write_barrier(jit_compiler_t* j, int base, int32_t disp) {
+    EMIT(j, 0xA8, 0x01, 0x75, 0x00);  // test al, 1; jnz done
+    uint8_t* to_done = j->p;
+    emit_lea(j, X86_ECX, base, disp);
+    emit_call_begin(j, 2);
+    emit_push_reg(j, X86_EAX);
+    emit_push_reg(j, X86_ECX);
+    emit_call_end(j, gc_write_barrier, 2);
+    to_done[-1] = j->p - to_done;
+}
+
+static void compile_sta(jit_compiler_t* j) {
+    emit_load(j, X86_EAX, X86_ESI, 4);  // an index or a variable
+    EMIT(j, 0xA8, 0x01, 0x74, 0x00);    // test al, 1; jz variable
+    uint8_t* to_variable = j->p;
+    emit_call_begin(j, 3);
+    emit_push_mem(j, X86_ESI, 8);
+    emit_push_reg(j, X86_EAX);
+    emit_push_mem(j, X86_ESI, 0);
+    emit_call_end(j, Bsta, 3);
+    emit_drop(j, 2);
+    EMIT(j, 0xEB, 0x00);  // jmp done
+    uint8_t* to_done = j->p;
+    to_variable[-1] = j->p - to_variable;
+    emit_call_begin(j, 3);
+    emit_push_reg(j, X86_EAX);
+    emit_push_reg(j, X86_EAX);
+    emit_push_mem(j, X86_ESI, 0);
+    emit_call_end(j, Bsta, 3);
+    emit_drop(j, 1);
+    to_done[-1] = j->p - to_done;
+    emit_set_top(j, X86_EAX);
+}
+
+// calls f(BOX(n), tag, sp) for an object made of the top n values, which it replaces
+static void compile_init_from_end(jit_compiler_t* j, const void* f, int n, uint32_t tag) {
+    emit_sync_stack(j);
+    emit_call_begin(j, 3);
+    emit_push_reg(j, X86_ESI);
+    emit_push_imm(j, tag);
+    emit_push_imm(j, BOX(n));
+    emit_call_end(j, f, 3);
+    emit_drop(j, n - 1);
+    emit_set_top(j, X86_EAX);
+}
+
+static bool compile_insn(jit_compiler_t* j, const insn_t* i) {
+    static const void* const patt_functions[] = {
+        Bstring_patt, Bstring_tag_patt, Barray_tag_patt, Bsexp_tag_patt,
+        Bboxed_patt,  Bunboxed_patt,    Bclosure_tag_patt,
+    };
+    uint16_t op = get_base_opcode(i);
+    int base;
+    int32_t disp;
+    switch (op & 0xF0) {
+        case OPCODE(INSTRUCTION_BINOP, 0):
+            if (op < OPCODE(INSTRUCTION_BINOP, 1) || op > OPCODE(INSTRUCTION_BINOP, 13))
+                return false;
+            compile_binop(j, op & 0x0F);
+            return true;
+        case OPCODE(INSTRUCTION_LD, 0):
+            if (!emit_var(j, op & 0x0F, i->a.n, &base, &disp))
+                return false;
+            emit_load(j, X86_EAX, base, disp);
+            emit_push_stack(j, X86_EAX);
+            return true;
+        case OPCODE(INSTRUCTION_LDA, 0):
+            if (!emit_var(j, op & 0x0F, i->a.n, &base, &disp))
+                return false;
+            emit_lea(j, X86_EAX, base, disp);
+            emit_push_stack(j, X86_EAX);
+            return true;
+        case OPCODE(INSTRUCTION_ST, 0):
+            if (!emit_var(j, op & 0x0F, i->a.n, &base, &disp))
+                return false;
+            emit_load(j, X86_EAX, X86_ESI, 0);
+            emit_store(j, X86_EAX, base, disp);
+            if ((op & 0x0F) == MEM_CLOSED)
+                compile_write_barrier(j, base, disp);
+            return true;
+        case OPCODE(INSTRUCTION_PATT, 0):
+            if (op == OPCODE(INSTRUCTION_PATT, 0)) {
+                emit_call_begin(j, 2);
+                emit_push_mem(j, X86_ESI, 4);
+                emit_push_mem(j, X86_ESI, 0);
+                emit_call_end(j, Bstring_patt, 2);
+                emit_drop(j, 1);
+                emit_set_top(j, X86_EAX);
+                return true;
+            }
+            if (op > OPCODE(INSTRUCTION_PATT, 6))
+                return false;
+            compile_unary_call(j, patt_functions[op & 0x0F]);
+            return true;
+    }
+
+    switch (op) {
+        case OPCODE(INSTRUCTION_DATA, DATA_CONST):
+            emit_drop(j, -1);
+            emit_store_imm(j, X86_ESI, 0, BOX(i->a.n));
+            return true;
+        case OPCODE(INSTRUCTION_DATA, DATA_STRING):
+            emit_sync_stack(j);
+            emit_call_begin(j, 1);
+            emit_push_imm(j, (uint32_t)(size_t)i->b.ptr);
+            emit_call_end(j, Bstring_literal, 1);
+            emit_push_stack(j, X86_EAX);
+            return true;
+        case OPCODE(INSTRUCTION_DATA, DATA_SEXP):
+            emit_sync_stack(j);
+            emit_call_begin(j, 3);
+            emit_push_reg(j, X86_ESI);
+            emit_push_imm(j, i->c.n);
+            emit_push_imm(j, BOX(i->b.n));
+            emit_call_end(j, Bsexp_init_from_end, 3);
+            emit_drop(j, i->b.n - 1);
+            emit_set_top(j, X86_EAX);
+            return true;
+        case OPCODE(INSTRUCTION_DATA, DATA_STI):
+            emit_load(j, X86_EAX, X86_ESI, 0);
+            emit_load(j, X86_ECX, X86_ESI, 4);
+            emit_store(j, X86_EAX, X86_ECX, 0);
+            compile_write_barrier(j, X86_ECX, 0);
+            emit_drop(j, 2);
+            return true;
+        case OPCODE(INSTRUCTION_DATA, DATA_STA):
+            compile_sta(j);
+            return true;
+        case OPCODE(INSTRUCTION_DATA, DATA_JUMP):
+            return emit_branch(j, 0, i->a.target);
+        case OPCODE(INSTRUCTION_DATA, DATA_END):
+        case OPCODE(INSTRUCTION_DATA, DATA_RET):
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CALLC):
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL):
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_FAIL):
+            emit_exit(j, i);
+            return true;
+        case OPCODE(INSTRUCTION_DATA, DATA_DROP):
+            emit_drop(j, 1);
+            return true;
+        case OPCODE(INSTRUCTION_DATA, DATA_DUP):
+            emit_load(j, X86_EAX, X86_ESI, 0);
+            emit_push_stack(j, X86_EAX);
+            return true;
+        case OPCODE(INSTRUCTION_DATA, DATA_SWAP):
+            emit_load(j, X86_EAX, X86_ESI, 0);
+            emit_load(j, X86_ECX, X86_ESI, 4);
+            emit_store(j, X86_ECX, X86_ESI, 0);
+            emit_store(j, X86_EAX, X86_ESI, 4);
+            return true;
+        case OPCODE(INSTRUCTION_DATA, DATA_ELEM):
+            emit_call_begin(j, 2);
+            emit_push_mem(j, X86_ESI, 0);
+            emit_push_mem(j, X86_ESI, 4);
+            emit_call_end(j, Belem, 2);
+            emit_drop(j, 1);
+            emit_set_top(j, X86_EAX);
+            return true;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPZ):
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPNZ):
+            emit_load(j, X86_EAX, X86_ESI, 0);
+            emit_drop(j, 1);
+            EMIT(j, 0xD1, 0xF8, 0x85, 0xC0);  // sar eax, 1; test eax, eax
+            return emit_branch(j, op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPZ) ? 0x84 : 0x85,
+                               i->a.target);
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_CLOJURE): {
+            const capture_t* captures = i->c.ptr;
+            for (int k = 0; k < i->b.n; k++) {
+                if (!emit_var(j, captures[k].mem, captures[k].idx, &base, &disp))
+                    return false;
+                emit_load(j, X86_EAX, base, disp);
+                emit_push_stack(j, X86_EAX);
+            }
+            compile_init_from_end(j, Bclosure_init_from_end, i->b.n, i->a.n);
+            return true;
+        }
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_TAG):
+            emit_call_begin(j, 3);
+            emit_push_imm(j, BOX(i->b.n));
+            emit_push_imm(j, i->c.n);
+            emit_push_mem(j, X86_ESI, 0);
+            emit_call_end(j, Btag, 3);
+            emit_set_top(j, X86_EAX);
+            return true;
+        case OPCODE(INSTRUCTION_CONTROL, CONTROL_ARRAY):
+            emit_call_begin(j, 2);
+            emit_push_imm(j, BOX(i->a.n));
+            emit_push_mem(j, X86_ESI, 0);
+            emit_call_end(j, Barray_patt, 2);
+            emit_set_top(j, X86_EAX);
+            return true;
+        case OPCODE(INSTRUCTION_CALL, CALL_READ):
+            emit_call_begin(j, 0);
+            emit_call_end(j, Lread, 0);
+            emit_push_stack(j, X86_EAX);
+            return true;
+        case OPCODE(INSTRUCTION_CALL, CALL_WRITE):
+            compile_unary_call(j, Lwrite);
+            return true;
+        case OPCODE(INSTRUCTION_CALL, CALL_LENGTH):
+            compile_unary_call(j, Llength);
+            return true;
+        case OPCODE(INSTRUCTION_CALL, CALL_STRING):
+            // the argument is popped before the GC can run, as in handle_call_string
+            emit_load(j, X86_EAX, X86_ESI, 0);
+            emit_drop(j, 1);
+            emit_sync_stack(j);
+            emit_call_begin(j, 1);
+            emit_push_reg(j, X86_EAX);
+            emit_call_end(j, Lstring, 1);
+            emit_push_stack(j, X86_EAX);
+            return true;
+        case OPCODE(INSTRUCTION_CALL, CALL_ARRAY):
+            emit_sync_stack(j);
+            emit_call_begin(j, 2);
+            emit_push_reg(j, X86_ESI);
+            emit_push_imm(j, BOX(i->a.n));
+            emit_call_end(j, Barray_init_from_end, 2);
+            emit_drop(j, i->a.n - 1);
+            emit_set_top(j, X86_EAX);
+            return true;
+        case OPCODE(INSTRUCTION_CALL, CALL_EXTERN): {
+            // the arguments are pushed from the last one, the top of the stack
+            const builtin_t* f = i->c.ptr;
+            emit_sync_stack(j);
+            emit_call_begin(j, i->b.n);
+            for (int k = 0; k < i->b.n; k++)
+                emit_push_mem(j, X86_ESI, k * 4);
+            emit_call_end(j, f->function, i->b.n);
+            emit_drop(j, i->b.n - 1);
+            if (f->flags & BUILTIN_VOID)
+                emit_store_imm(j, X86_ESI, 0, BOX(0));
+            else
+                emit_set_top(j, X86_EAX);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_jit_exit(uint16_t op) {
+    return op == OPCODE(INSTRUCTION_DATA, DATA_END) || op == OPCODE(INSTRUCTION_DATA, DATA_RET) ||
+           op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CALLC) ||
+           op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL) ||
+           op == OPCODE(INSTRUCTION_CONTROL, CONTROL_FAIL);
+}
+
+static void free_jit_compiler(jit_compiler_t* j) {
+    free(j->code_of_insn);
+    free(j->fixups);
+}
+
+/* Compiles the body of the function starting at the given BEGIN to machine code.
+   Returns the entry of the code, or 0 if the function is not supported. */
+static const void* compile_function(context_t* c, insn_t* begin,
+                                    const void* const* dispatch_table) {
+    jit_compiler_t j = {
+        .c = c,
+        .jit = c->program->jit,
+        .body = begin,
+        .n = get_function_length(c, begin),
+        .args_n = begin->a.n,
+        .locals_n = begin->b.n,
+        .is_closure = begin->op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CBEGIN),
+    };
+    if (j.n == 0)
+        return 0;
+    size_t exits_n = 0, max_size = 0;
+    for (size_t k = 1; k < j.n; k++) {
+        uint16_t op = get_base_opcode(&begin[k]);
+        if (is_jit_exit(op))
+            exits_n += 2;
+        max_size += JIT_MAX_TEMPLATE_SIZE;
+        if (op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CLOJURE))
+            max_size += begin[k].b.n * JIT_MAX_CAPTURE_SIZE;
+    }
+    j.code_of_insn = malloc(j.n * sizeof(uint8_t*));
+    j.fixups = malloc(j.n * sizeof(jit_fixup_t));
+    j.exits = malloc(exits_n * sizeof(insn_t));
+    if (j.code_of_insn == 0 || j.fixups == 0 || j.exits == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+
+    uint8_t* code = allocate_jit_code(j.jit, max_size);
+    j.p = code;
+    for (size_t k = 1; k < j.n; k++) {
+        j.code_of_insn[k] = j.p;
+        if (!compile_insn(&j, &begin[k])) {
+            commit_jit_code(j.jit, code);
+            free(j.exits);
+            free_jit_compiler(&j);
+            return 0;
+        }
+    }
+    if (j.p > code + max_size)
+        failure("JIT: the code of a function exceeds its estimate\n");
+
+    for (jit_fixup_t* f = j.fixups; f < j.fixups + j.fixups_n; f++) {
+        uint32_t rel = (uint32_t)(size_t)j.code_of_insn[f->target] - (uint32_t)(size_t)(f->at + 4);
+        memcpy(f->at, &rel, sizeof(rel));
+    }
+    for (insn_t* i = j.exits; i < j.exits + j.exits_n; i++)
+        i->handler = dispatch_table[i->op];
+    add_code_block(c->program, j.exits, j.exits_n);
+    commit_jit_code(j.jit, j.p);
+    free_jit_compiler(&j);
+    return code;
+}
+
+/* The entry and the exit of compiled code: the entry saves the registers the caller
+   expects to be preserved, aligns the stack and loads sp and bp from the context,
+   the exit stores sp back and returns to the caller of the entry. */
+static jit_t* create_jit(void) {
+    jit_t* jit = malloc(sizeof(jit_t));
+    if (jit == 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    jit->chunks = 0;
+    jit_compiler_t j = {.p = allocate_jit_code(jit, JIT_MAX_TEMPLATE_SIZE)};
+    jit->enter = (void (*)(context_t*, const void*))j.p;
+    EMIT(&j, 0x55, 0x53, 0x56, 0x57);        // push ebp; push ebx; push esi; push edi
+    EMIT(&j, 0x8B, 0x5C, 0x24, 0x14);        // mov ebx, [esp + 20]: the context
+    EMIT(&j, 0x8B, 0x44, 0x24, 0x18);        // mov eax, [esp + 24]: the code
+    EMIT(&j, 0x89, 0xE5, 0x83, 0xE4, 0xF0);  // mov ebp, esp; and esp, -16
+    emit_load(&j, X86_ESI, X86_EBX, offsetof(context_t, sp));
+    emit_load(&j, X86_EDI, X86_EBX, offsetof(context_t, bp));
+    EMIT(&j, 0xFF, 0xE0);  // jmp eax
+    jit->leave = j.p;
+    emit_store(&j, X86_ESI, X86_EBX, offsetof(context_t, sp));
+    EMIT(&j, 0x89, 0xEC);                    // mov esp, ebp
+    EMIT(&j, 0x5F, 0x5E, 0x5B, 0x5D, 0xC3);  // pop edi; pop esi; pop ebx; pop ebp; ret
+    commit_jit_code(jit, j.p);
+    return jit;
+}
+
+#undef EMIT
+
+// runs compiled code until it leaves with ip set to an instruction for the interpreter
+static inline void run_jit_code(context_t* c, const void* code) {
+    flush_stack_top(c);  // the code keeps every value in its slot
+    c->program->jit->enter(c, code);
+    reload_stack_top(c);
+}
+#endif
+
+#ifdef PROFILE_SEQUENCES
+/* Counters of executed pairs and triples of opcodes, printed on exit.
+   Superinstructions are not fused in this mode, so the counts are in plain bytecode. */
+#define PROFILE_TRIPLES_SIZE (1 << 16)
+#define PROFILE_TOP 20
+
+typedef struct {
+    uint32_t key;
+    size_t count;
+} profile_entry_t;
+
+static size_t profile_pairs[256][256];
+static profile_entry_t profile_triples[PROFILE_TRIPLES_SIZE];
+static uint32_t profile_history;
+
+static inline void profile_insn(uint16_t op) {
+    profile_history = ((profile_history << 8) | op) & 0xFFFFFF;
+    profile_pairs[(profile_history >> 8) & 0xFF][op]++;
+
+    uint32_t key = profile_history | (1 << 24);  // never zero, zero marks a free slot
+    size_t h = (key * 2654435761u) % PROFILE_TRIPLES_SIZE;
+    while (profile_triples[h].key != 0 && profile_triples[h].key != key)
+        h = (h + 1) % PROFILE_TRIPLES_SIZE;
+    profile_triples[h].key = key;
+    profile_triples[h].count++;
+}
+
+static int compare_profile_entries(const void* x, const void* y) {
+    size_t cx = ((const profile_entry_t*)x)->count, cy = ((const profile_entry_t*)y)->count;
+    return (cx < cy) - (cx > cy);
+}
+
+static void profile_dump(void) {
+    static profile_entry_t pairs[256 * 256];
+    size_t pairs_n = 0;
+    for (uint32_t k = 0; k < 256 * 256; k++) {
+        size_t count = profile_pairs[k >> 8][k & 0xFF];
+        if (count != 0)
+            pairs[pairs_n++] = (profile_entry_t){.key = k, .count = count};
+    }
+    qsort(pairs, pairs_n, sizeof(profile_entry_t), compare_profile_entries);
+    qsort(profile_triples, PROFILE_TRIPLES_SIZE, sizeof(profile_entry_t), compare_profile_entries);
+
+    fprintf(stderr, "Most frequent pairs:\n");
+    for (size_t i = 0; i < pairs_n && i < PROFILE_TOP; i++)
+        fprintf(stderr, "  0x%.2x 0x%.2x\t%zu\n", pairs[i].key >> 8, pairs[i].key & 0xFF,
+                pairs[i].count);
+    fprintf(stderr, "Most frequent triples:\n");
+    for (size_t i = 0; i < PROFILE_TOP && profile_triples[i].count != 0; i++) {
+        uint32_t key = profile_triples[i].key;
+        fprintf(stderr,
+                "  0x%.2x 0x%.2x 0x%.2x\t%zu\n",
+                (key >> 16) & 0xFF,
+                (key >> 8) & 0xFF,
+                key & 0xFF,
+                profile_triples[i].count);
+    }
+}
+#endif
+
+/*
+The stacks are reserved rather than allocated: their pages are committed when they are
+first touched, so a small program does not pay for the maximum size. Below each stack
+is a guard region with no access. It is at least as large as the largest frame, so that
+no write of a frame that does not fit can skip over it, and a fault in it is reported
+as a stack overflow by on_segv.
+*/
+typedef struct {
+    const uint8_t* begin;
+    const uint8_t* end;
+    size_t size; /* of the whole mapping: the guard and the stack */
+} guard_t;
+
+/* The signal comes to the thread that faults, so each thread knows the guards of the
+   program it runs. The handler is installed once per process, the one of the runtime is
+   below it */
+static __thread guard_t stack_guards[2];
+static struct sigaction previous_segv;
+static pthread_once_t segv_handler_once = PTHREAD_ONCE_INIT;
+
+// only async-signal-safe calls here: the fault can come in the middle of stdio or malloc
+static void on_segv(int sig, siginfo_t* info, void* ucontext) {
+    static const char message[] = "*** FAILURE: Stack overflow\n";
+    const uint8_t* a = info->si_addr;
+    for (size_t k = 0; k < sizeof(stack_guards) / sizeof(stack_guards[0]); k++) {
+        if (stack_guards[k].begin <= a && a < stack_guards[k].end) {
+            write(STDERR_FILENO, message, sizeof(message) - 1);
+            _exit(255);  // as failure() does
+        }
+    }
+    sigaction(SIGSEGV, &previous_segv, 0);  // the fault repeats and goes to the runtime
+}
+
+// size bytes of a stack growing down to a guard region of at least guard_size bytes
+static void* reserve_stack(size_t size, size_t guard_size, guard_t* guard) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX / 2 || guard_size > SIZE_MAX / 2 - 2 * page)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    guard_size = (guard_size / page + 1) * page;
+    size = (size + page - 1) / page * page;
+    uint8_t* p = mmap(0, guard_size + size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED || mprotect(p, guard_size, PROT_NONE) != 0)
+        failure("*** FAILURE: unable to allocate memory.\n");
+    *guard = (guard_t){.begin = p, .end = p + guard_size, .size = guard_size + size};
+    return p + guard_size;
+}
+
+static void release_stack(guard_t* guard) {
+    munmap((void*)guard->begin, guard->size);
+    *guard = (guard_t){0};
+}
+
+static void install_segv_handler(void) {
+    struct sigaction sa = {.sa_sigaction = on_segv, .sa_flags = SA_SIGINFO};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &previous_segv);
+}
+
+static void handle_stack_overflows(void) {
+    pthread_once(&segv_handler_once, install_segv_handler);
+}
+
+/* Command line options */
+typedef struct {
+    bool jit;              /* compile functions to machine code, turned off by --no-jit */
+    bool cache;            /* load through a program image, turned on by --cache      */
+    const char* cache_dir; /* of the images, --cache-dir=DIR; next to the file if 0  */
+    size_t stack_size;     /* words of the operand stack and records of the call stack */
+} options_t;
+
+/* Interprets the pre-decoded program in the current isolate, the one it is loaded in.
+   Dispatch is direct-threaded: every record holds the address of its handler and
+   every handler ends with its own indirect jump, so each opcode gets a separate
+   branch prediction site. */
+void disassemble(FILE* f, program_t* p, const options_t* options) {
+#ifdef PROFILE_SEQUENCES
+#define DISPATCH()                      \
+    do {                                \
+        profile_insn(context.ip->op);   \
+        goto* context.ip->handler;      \
+    } while (0)
+#else
+#define DISPATCH() goto* context.ip->handler
+#endif
+#define FAIL \
+    failure("ERROR: invalid opcode %d-%d\n", (context.ip->op & 0xF0) >> 4, context.ip->op & 0x0F)
+    static const void* const dispatch_table[OPCODES_NUMBER] = {
+        [0 ... OPCODES_NUMBER - 1] = &&op_invalid,
+
+        [OPCODE(INSTRUCTION_BINOP, 1)] = &&op_binop_add,
+        [OPCODE(INSTRUCTION_BINOP, 2)] = &&op_binop_sub,
+        [OPCODE(INSTRUCTION_BINOP, 3)] = &&op_binop_mul,
+        [OPCODE(INSTRUCTION_BINOP, 4)] = &&op_binop_div,
+        [OPCODE(INSTRUCTION_BINOP, 5)] = &&op_binop_mod,
+        [OPCODE(INSTRUCTION_BINOP, 6)] = &&op_binop_lt,
+        [OPCODE(INSTRUCTION_BINOP, 7)] = &&op_binop_le,
+        [OPCODE(INSTRUCTION_BINOP, 8)] = &&op_binop_gt,
+        [OPCODE(INSTRUCTION_BINOP, 9)] = &&op_binop_ge,
+        [OPCODE(INSTRUCTION_BINOP, 10)] = &&op_binop_eq,
+        [OPCODE(INSTRUCTION_BINOP, 11)] = &&op_binop_ne,
+        [OPCODE(INSTRUCTION_BINOP, 12)] = &&op_binop_and,
+        [OPCODE(INSTRUCTION_BINOP, 13)] = &&op_binop_or,
+
+        [OPCODE(INSTRUCTION_DATA, DATA_CONST)] = &&op_const,
+        [OPCODE(INSTRUCTION_DATA, DATA_STRING)] = &&op_string,
+        [OPCODE(INSTRUCTION_DATA, DATA_SEXP)] = &&op_sexp,
+        [OPCODE(INSTRUCTION_DATA, DATA_STI)] = &&op_sti,
+        [OPCODE(INSTRUCTION_DATA, DATA_STA)] = &&op_sta,
+        [OPCODE(INSTRUCTION_DATA, DATA_JUMP)] = &&op_jump,
+        [OPCODE(INSTRUCTION_DATA, DATA_END)] = &&op_end,
+        [OPCODE(INSTRUCTION_DATA, DATA_RET)] = &&op_ret,
+        [OPCODE(INSTRUCTION_DATA, DATA_DROP)] = &&op_drop,
+        [OPCODE(INSTRUCTION_DATA, DATA_DUP)] = &&op_dup,
+        [OPCODE(INSTRUCTION_DATA, DATA_SWAP)] = &&op_swap,
+        [OPCODE(INSTRUCTION_DATA, DATA_ELEM)] = &&op_elem,
+
+        [OPCODE(INSTRUCTION_LD, MEM_GLOBAL)] = &&op_ld_global,
+        [OPCODE(INSTRUCTION_LD, MEM_LOCAL)] = &&op_ld_local,
+        [OPCODE(INSTRUCTION_LD, MEM_ARG)] = &&op_ld_arg,
+        [OPCODE(INSTRUCTION_LD, MEM_CLOSED)] = &&op_ld_closed,
+        [OPCODE(INSTRUCTION_LDA, MEM_GLOBAL)] = &&op_lda_global,
+        [OPCODE(INSTRUCTION_LDA, MEM_LOCAL)] = &&op_lda_local,
+        [OPCODE(INSTRUCTION_LDA, MEM_ARG)] = &&op_lda_arg,
+        [OPCODE(INSTRUCTION_LDA, MEM_CLOSED)] = &&op_lda_closed,
+        [OPCODE(INSTRUCTION_ST, MEM_GLOBAL)] = &&op_st_global,
+        [OPCODE(INSTRUCTION_ST, MEM_LOCAL)] = &&op_st_local,
+        [OPCODE(INSTRUCTION_ST, MEM_ARG)] = &&op_st_arg,
+        [OPCODE(INSTRUCTION_ST, MEM_CLOSED)] = &&op_st_closed,
+
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPZ)] = &&op_cjmpz,
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_CJMPNZ)] = &&op_cjmpnz,
+#if REG_TIER_THRESHOLD > 0 && !defined(PROFILE_SEQUENCES)
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_BEGIN)] = &&op_begin_counting,
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_CBEGIN)] = &&op_begin_counting,
+#else
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_BEGIN)] = &&op_begin,
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_CBEGIN)] = &&op_begin,
+#endif
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_CLOJURE)] = &&op_clojure,
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_CALLC)] = &&op_callc,
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_CALL)] = &&op_call,
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_TAG)] = &&op_tag,
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_ARRAY)] = &&op_array,
+        [OPCODE(INSTRUCTION_CONTROL, CONTROL_FAIL)] = &&op_fail,
+
+        [OPCODE(INSTRUCTION_PATT, 0)] = &&op_patt_string,
+        [OPCODE(INSTRUCTION_PATT, 1)] = &&op_patt_string_tag,
+        [OPCODE(INSTRUCTION_PATT, 2)] = &&op_patt_array_tag,
+        [OPCODE(INSTRUCTION_PATT, 3)] = &&op_patt_sexp_tag,
+        [OPCODE(INSTRUCTION_PATT, 4)] = &&op_patt_boxed,
+        [OPCODE(INSTRUCTION_PATT, 5)] = &&op_patt_unboxed,
+        [OPCODE(INSTRUCTION_PATT, 6)] = &&op_patt_closure_tag,
+
+        [OPCODE(INSTRUCTION_CALL, CALL_READ)] = &&op_call_read,
+        [OPCODE(INSTRUCTION_CALL, CALL_WRITE)] = &&op_call_write,
+        [OPCODE(INSTRUCTION_CALL, CALL_LENGTH)] = &&op_call_length,
+        [OPCODE(INSTRUCTION_CALL, CALL_STRING)] = &&op_call_string,
+        [OPCODE(INSTRUCTION_CALL, CALL_ARRAY)] = &&op_call_array,
+        [OPCODE(INSTRUCTION_CALL, CALL_EXTERN)] = &&op_call_extern,
+
+        [OPCODE(INSTRUCTION_EXIT, 0) ... OPCODE(INSTRUCTION_EXIT, 15)] = &&op_exit,
+
+        [SUPER_LD_LD_BINOP] = &&op_super_ld_ld_binop,
+        [SUPER_LD_CONST_BINOP] = &&op_super_ld_const_binop,
+        [SUPER_CONST_BINOP] = &&op_super_const_binop,
+        [SUPER_BINOP_CJMPZ] = &&op_super_binop_cjmpz,
+        [SUPER_LD_CJMPZ] = &&op_super_ld_cjmpz,
+        [SUPER_DUP_TAG_CJMPZ] = &&op_super_dup_tag_cjmpz,
+        [SUPER_DUP_ARRAY_CJMPZ] = &&op_super_dup_array_cjmpz,
+        [SUPER_ST_DROP] = &&op_super_st_drop,
+        [SUPER_LD_ELEM] = &&op_super_ld_elem,
+        [SUPER_CONST_ELEM] = &&op_super_const_elem,
+        [SUPER_STRING_PATT] = &&op_super_string_patt,
+        [SUPER_STRING_LENGTH] = &&op_super_string_length,
+        [SUPER_TAIL_CALL] = &&op_super_tail_call,
+        [SUPER_TAIL_CALLC] = &&op_super_tail_callc,
+        [SUPER_CASE] = &&op_super_case,
+
+        [REG_MOV] = &&op_reg_mov,
+        [REG_CONST] = &&op_reg_const,
+        [REG_LOAD_GLOBAL] = &&op_reg_load_global,
+        [REG_LOAD_CLOSED] = &&op_reg_load_closed,
+        [REG_STORE_GLOBAL] = &&op_reg_store_global,
+        [REG_STORE_CLOSED] = &&op_reg_store_closed,
+        [REG_BINOP] = &&op_reg_binop,
+        [REG_BINOP_IMM] = &&op_reg_binop_imm,
+        [REG_JUMP] = &&op_reg_jump,
+        [REG_JZ] = &&op_reg_jz,
+        [REG_JNZ] = &&op_reg_jnz,
+        [REG_ENTER] = &&op_reg_enter,
+        [REG_LEAVE] = &&op_reg_leave,
+        [REG_CALL] = &&op_reg_call,
+        [REG_END] = &&op_reg_end,
+#ifdef HAS_JIT
+        [JIT_RESUME] = &&op_jit_resume,
+#endif
+    };
+
+#ifdef PROFILE_SEQUENCES
+    atexit(profile_dump);
+#endif
+    context_t context;
+    context.isolate = current_isolate;
+    size_t global_size = p->global_area_size;
+    size_t stack_size = options->stack_size;
+    if (global_size > MAX_STACK_SIZE - stack_size)
+        failure("The stack of %zu words and %zu globals do not fit into memory\n", stack_size,
+                global_size);
+    // the globals are right above the operand stack, the GC scans them as a part of it
+    size_t* data_mem = reserve_stack((stack_size + global_size) * sizeof(size_t),
+                                     p->max_frame * sizeof(size_t), &stack_guards[0]);
+    context.frames.begin =
+        reserve_stack(stack_size * sizeof(frame_t), sizeof(frame_t), &stack_guards[1]);
+    context.frames.n = stack_size;
+    context.frames.fp = context.frames.begin + context.frames.n;
+    handle_stack_overflows();
+
+    context.stack.p = data_mem;
+    context.stack.n = stack_size;
+
+    context.globals.p = data_mem + stack_size;
+    context.globals.n = global_size;
+    for (int i = 0; i < global_size; i++)
+        context.globals.p[i] = 0;
+
+#ifdef HAS_JIT
+    if (options->jit && p->jit == 0)
+        p->jit = create_jit();
+#endif
+    for (insn_t* i = p->code.p; i < p->code.p + p->code.n; i++) {
+        i->handler = dispatch_table[i->op];
+#ifdef HAS_JIT
+        if (p->jit != 0 && (i->op == OPCODE(INSTRUCTION_CONTROL, CONTROL_BEGIN) ||
+                            i->op == OPCODE(INSTRUCTION_CONTROL, CONTROL_CBEGIN)))
+            i->handler = &&op_jit_compile;
+#endif
+    }
+    context.program = p;
+    context.code = p->code;
+    set_ip(&context, context.code.p);
+
+    context.is_closure = false;
+
+    context.isolate->gc_stack_bottom = (size_t)(data_mem + stack_size + global_size);
+
+    // two arguments because main's BEGIN 2 0, the first one is stored directly into the empty stack
+    context.sp = context.stack.p + context.stack.n - 1;
+    *context.sp = BOX(0);
+    context.tos = BOX(0);
+    push_stack_boxed(&context, 0);
+    sync_stack(&context);
+    context.bp = get_stack_sp(&context);
+
+    DISPATCH();
+
+op_binop_add:
+    handle_binop(&context, 1);
+    DISPATCH();
+op_binop_sub:
+    handle_binop(&context, 2);
+    DISPATCH();
+op_binop_mul:
+    handle_binop(&context, 3);
+    DISPATCH();
+op_binop_div:
+    handle_binop(&context, 4);
+    DISPATCH();
+op_binop_mod:
+    handle_binop(&context, 5);
+    DISPATCH();
+op_binop_lt:
+    handle_binop(&context, 6);
+    DISPATCH();
+op_binop_le:
+    handle_binop(&context, 7);
+    DISPATCH();
+op_binop_gt:
+    handle_binop(&context, 8);
+    DISPATCH();
+op_binop_ge:
+    handle_binop(&context, 9);
+    DISPATCH();
+op_binop_eq:
+    handle_binop(&context, 10);
+    DISPATCH();
+op_binop_ne:
+    handle_binop(&context, 11);
+    DISPATCH();
+op_binop_and:
+    handle_binop(&context, 12);
+    DISPATCH();
+op_binop_or:
+    handle_binop(&context, 13);
+    DISPATCH();
+
+op_const:
+    handle_const(&context);
+    DISPATCH();
+op_string:
+    handle_string(&context);
+    DISPATCH();
+op_sexp:
+    handle_sexp(&context);
+    DISPATCH();
+op_sti:
+    handle_sti(&context);
+    DISPATCH();
+op_sta:
+    handle_sta(&context);
+    DISPATCH();
+op_jump:
+    handle_jump(&context);
+    DISPATCH();
+op_end:
+    if (handle_end(&context))
+        goto done;
+    DISPATCH();
+op_ret:
+    handle_ret(&context);
+    DISPATCH();
+op_drop:
+    handle_drop(&context);
+    DISPATCH();
+op_dup:
+    handle_dup(&context);
+    DISPATCH();
+op_swap:
+    handle_swap(&context);
+    DISPATCH();
+op_elem:
+    handle_elem(&context);
+    DISPATCH();
+
+op_ld_global:
+    handle_ld(&context, MEM_GLOBAL);
+    DISPATCH();
+op_ld_local:
+    handle_ld(&context, MEM_LOCAL);
+    DISPATCH();
+op_ld_arg:
+    handle_ld(&context, MEM_ARG);
+    DISPATCH();
+op_ld_closed:
+    handle_ld(&context, MEM_CLOSED);
+    DISPATCH();
+op_lda_global:
+    handle_lda(&context, MEM_GLOBAL);
+    DISPATCH();
+op_lda_local:
+    handle_lda(&context, MEM_LOCAL);
+    DISPATCH();
+op_lda_arg:
+    handle_lda(&context, MEM_ARG);
+    DISPATCH();
+op_lda_closed:
+    handle_lda(&context, MEM_CLOSED);
+    DISPATCH();
+op_st_global:
+    handle_st(&context, MEM_GLOBAL);
+    DISPATCH();
+op_st_local:
+    handle_st(&context, MEM_LOCAL);
+    DISPATCH();
+op_st_arg:
+    handle_st(&context, MEM_ARG);
+    DISPATCH();
+op_st_closed:
+    handle_st(&context, MEM_CLOSED);
+    DISPATCH();
+
+op_cjmpz:
+    handle_cjmpz(&context);
+    DISPATCH();
+op_cjmpnz:
+    handle_cjmpnz(&context);
+    DISPATCH();
+op_begin:
+    handle_begin(&context);
+    DISPATCH();
+op_clojure:
+    handle_clojure(&context);
+    DISPATCH();
+op_callc:
+    // a cached callee that is interpreted is entered without dispatching its CBEGIN
+    if (handle_callc(&context)->handler == &&op_begin)
+        goto op_begin;
+    DISPATCH();
+op_call:
+    if (handle_call(&context)->handler == &&op_begin)
+        goto op_begin;
+    DISPATCH();
+op_tag:
+    handle_tag(&context);
+    DISPATCH();
+op_array:
+    handle_array(&context);
+    DISPATCH();
+op_fail:
+    handle_fail(&context);
+    DISPATCH();
+
+op_patt_string:
+    handle_patt(&context, 0);
+    DISPATCH();
+op_patt_string_tag:
+    handle_patt(&context, 1);
+    DISPATCH();
+op_patt_array_tag:
+    handle_patt(&context, 2);
+    DISPATCH();
+op_patt_sexp_tag:
+    handle_patt(&context, 3);
+    DISPATCH();
+op_patt_boxed:
+    handle_patt(&context, 4);
+    DISPATCH();
+op_patt_unboxed:
+    handle_patt(&context, 5);
+    DISPATCH();
+op_patt_closure_tag:
+    handle_patt(&context, 6);
+    DISPATCH();
+
+op_call_read:
+    handle_call_read(&context);
+    DISPATCH();
+op_call_write:
+    handle_call_write(&context);
+    DISPATCH();
+op_call_length:
+    handle_call_length(&context);
+    DISPATCH();
+op_call_string:
+    handle_call_string(&context);
+    DISPATCH();
+op_call_array:
+    handle_call_array(&context);
+    DISPATCH();
+
+op_call_extern:
+    handle_call_extern(&context);
+    DISPATCH();
+
+op_super_ld_ld_binop:
+    handle_super_ld_ld_binop(&context);
+    DISPATCH();
+op_super_ld_const_binop:
+    handle_super_ld_const_binop(&context);
+    DISPATCH();
+op_super_const_binop:
+    handle_super_const_binop(&context);
+    DISPATCH();
+op_super_binop_cjmpz:
+    handle_super_binop_cjmpz(&context);
+    DISPATCH();
+op_super_ld_cjmpz:
+    handle_super_ld_cjmpz(&context);
+    DISPATCH();
+op_super_dup_tag_cjmpz:
+    handle_super_dup_tag_cjmpz(&context);
+    DISPATCH();
+op_super_dup_array_cjmpz:
+    handle_super_dup_array_cjmpz(&context);
+    DISPATCH();
+op_super_st_drop:
+    handle_super_st_drop(&context);
+    DISPATCH();
+op_super_ld_elem:
+    handle_super_ld_elem(&context);
+    DISPATCH();
+op_super_const_elem:
+    handle_super_const_elem(&context);
+    DISPATCH();
+op_super_string_patt:
+    handle_super_string_patt(&context);
+    DISPATCH();
+op_super_string_length:
+    handle_super_string_length(&context);
+    DISPATCH();
+op_super_tail_call:
+    if (handle_tail_call(&context)->handler == &&op_begin)
+        goto op_begin;
+    DISPATCH();
+op_super_tail_callc:
+    if (handle_tail_callc(&context)->handler == &&op_begin)
+        goto op_begin;
+    DISPATCH();
+op_super_case:
+    handle_super_case(&context);
+    DISPATCH();
+
+// BEGIN of a function that is not translated yet: counts calls and translates it once it is hot
+#define COUNT_CALL(plain, translated)                                              \
+    do {                                                                           \
+        insn_t* begin = context.ip;                                                \
+        if (++begin->c.n < REG_TIER_THRESHOLD)                                     \
+            goto plain;                                                            \
+        insn_t* entry = translate_function(&context, begin, dispatch_table);       \
+        begin->handler = entry == 0 ? &&plain : &&translated;                      \
+        begin->c.target = entry;                                                   \
+        DISPATCH();                                                                \
+    } while (0)
+op_begin_counting:
+    COUNT_CALL(op_begin, op_reg_begin);
+#undef COUNT_CALL
+
+op_reg_begin:
+    handle_reg_begin(&context);
+    DISPATCH();
+op_reg_mov:
+    handle_reg_mov(&context);
+    DISPATCH();
+op_reg_const:
+    handle_reg_const(&context);
+    DISPATCH();
+op_reg_load_global:
+    handle_reg_load(&context, MEM_GLOBAL);
+    DISPATCH();
+op_reg_load_closed:
+    handle_reg_load(&context, MEM_CLOSED);
+    DISPATCH();
+op_reg_store_global:
+    handle_reg_store(&context, MEM_GLOBAL);
+    DISPATCH();
+op_reg_store_closed:
+    handle_reg_store(&context, MEM_CLOSED);
+    DISPATCH();
+op_reg_binop:
+    handle_reg_binop(&context);
+    DISPATCH();
+op_reg_binop_imm:
+    handle_reg_binop_imm(&context);
+    DISPATCH();
+op_reg_jump:
+    handle_reg_jump(&context);
+    DISPATCH();
+op_reg_jz:
+    handle_reg_jz(&context);
+    DISPATCH();
+op_reg_jnz:
+    handle_reg_jnz(&context);
+    DISPATCH();
+op_reg_enter:
+    handle_reg_enter(&context);
+    DISPATCH();
+op_reg_leave:
+    handle_reg_leave(&context);
+    DISPATCH();
+op_reg_call:
+    handle_reg_call(&context);
+    DISPATCH();
+op_reg_end:
+    if (handle_reg_end(&context))
+        goto done;
+    DISPATCH();
+
+#ifdef HAS_JIT
+// BEGIN of a function that is not compiled yet, the ones that cannot be compiled are interpreted
+op_jit_compile: {
+    insn_t* begin = context.ip;
+    const void* code = compile_function(&context, begin, dispatch_table);
+    begin->c.ptr = (void*)code;
+    begin->handler = code == 0 ? dispatch_table[begin->op] : &&op_jit_begin;
+    DISPATCH();
+}
+op_jit_begin: {
+    const void* code = context.ip->c.ptr;
+    handle_begin(&context);
+    run_jit_code(&context, code);
+    DISPATCH();
+}
+op_jit_resume:
+    run_jit_code(&context, context.ip->a.ptr);
+    DISPATCH();
+#endif
+
+op_exit:
+done:
+    release_stack(&stack_guards[0]);
+    release_stack(&stack_guards[1]);
+    context.isolate->gc_stack_top = 0;
+    context.isolate->gc_stack_bottom = 0;
+    return;
+
+op_invalid:
+    FAIL;
+#undef FAIL
+#undef DISPATCH
+}
+
+int main(int argc, char* argv[]) {
+    options_t options = {.jit = true, .stack_size = STACK_SIZE};
+    __init();  // the isolate of the program: its heap and the state of the runtime
+    char* fname = 0;
+    int files_n = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-jit") == 0) {
+            options.jit = false;
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            options.cache = true;
+        } else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+            options.cache = true;
+            options.cache_dir = argv[i] + 12;
+        } else if (strcmp(argv[i], "--generational") == 0) {
+            gc_enable_nursery(NURSERY_SIZE);
+        } else if (strncmp(argv[i], "--gc-threads=", 13) == 0) {
+            char* end;
+            long threads = strtol(argv[i] + 13, &end, 10);
+            if (*end != 0 || threads <= 0) {
+                printf("Invalid number of threads %s\n", argv[i] + 13);
+                return 1;
+            }
+            gc_set_threads(threads);
+        } else if (strncmp(argv[i], "--heap-size=", 12) == 0
+                   || strncmp(argv[i], "--heap-min=", 11) == 0
+                   || strncmp(argv[i], "--heap-max=", 11) == 0) {
+            const char* value = strchr(argv[i], '=') + 1;
+            size_t words = gc_parse_size(value);
+            if (words == 0) {
+                printf("Invalid heap size %s\n", value);
+                return 1;
+            }
+            gc_set_heap_size(strncmp(argv[i], "--heap-size=", 12) == 0 ? words : 0,
+                             strncmp(argv[i], "--heap-min=", 11) == 0 ? words : 0,
+                             strncmp(argv[i], "--heap-max=", 11) == 0 ? words : 0);
+        } else if (strncmp(argv[i], "--gc-time-ratio=", 16) == 0) {
+            char* end;
+            long percents = strtol(argv[i] + 16, &end, 10);
+            if (*end != 0 || percents <= 0 || percents >= 100) {
+                printf("Invalid GC time ratio %s\n", argv[i] + 16);
+                return 1;
+            }
+            gc_set_time_ratio(percents);
+        } else if (strncmp(argv[i], "--stack-size=", 13) == 0) {
+            char* end;
+            options.stack_size = strtoul(argv[i] + 13, &end, 10);
+            if (*end != 0 || options.stack_size == 0 || options.stack_size > MAX_STACK_SIZE) {
+                printf("Invalid stack size %s\n", argv[i] + 13);
+                return 1;
+            }
+        } else {
+            fname = argv[i];
+            files_n++;
+        }
+    }
+    if (files_n != 1) {
         printf("Specify file with bytecode!");
         return 1;
     }
-    bytefile* f = read_file(argv[1]);
-    disassemble(stdout, f);
-    free(f);
+    bytefile* f = read_file(fname);
+    program_t* p = options.cache ? load_cached_program(f, fname, options.cache_dir)
+                                 : load_program(f);
+    disassemble(stdout, p, &options);
+    free_program(p);
+    close_file(f);
+    __shutdown();
     return 0;
 }